@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Generate large Kaleidoscope inputs for the toy -bench modes.
+
+    python3 genks.py --shape mixed --size 8 > mixed.ks
+"""
+import argparse
+import random
+import sys
+
+
+def mixed(i, rnd):
+    # A definition in the style of the chapter test cases: comments, a few
+    # parameters, arithmetic, a conditional and a loop.
+    return (
+        "# helper %d: accumulate a scaled series\n"
+        "def series%d(start step count)\n"
+        "  var acc = 0, k = %d.%d in\n"
+        "  (for i = start, i < count, step in\n"
+        "     acc = acc + i * k - %d) :\n"
+        "  if acc < %d then acc else series%d(acc, step, count);\n\n"
+        % (i, i, rnd.randint(0, 99), rnd.randint(0, 999), rnd.randint(1, 50),
+           rnd.randint(100, 9999), max(i - 1, 0)))
+
+
+def commented(i, rnd):
+    # Long comment blocks, deep indentation and long identifiers: the runs the
+    # scanning kernels skip in bulk.
+    name = "accumulateScaledSeriesHelperNumber%d" % i
+    note = " ".join(rnd.choice(WORDS) for _ in range(14))
+    return (
+        "# %s\n# %s\n"
+        "def %s(startingValue stepAmount)\n"
+        "                startingValue * stepAmount + %s(stepAmount, startingValue);\n\n"
+        % (note, note[::-1], name, name))
+
+
+def idents(i, rnd):
+    # Identifier-heavy: many parameters referenced over and over, with names
+    # that share first letters and lengths with the keywords.
+    params = ["dx", "vv", "elem", "tx", "ix", "fr", "bin", "uy", "vr", "extent"]
+    body = " + ".join(rnd.choice(params) for _ in range(24))
+    return "def idents%d(%s)\n  %s;\n\n" % (i, " ".join(params), body)
+
+
+def chains(i, rnd):
+    # Long operator chains: ':' sequencing as in the ch7 test case, with
+    # arithmetic and comparisons inside each step, so nearly every other token
+    # is a binary operator whose precedence the parser has to look up.
+    steps = []
+    for _ in range(24):
+        terms = [rnd.choice(["x", "y", "%d.%d" % (rnd.randint(0, 99), rnd.randint(0, 9))])
+                 for _ in range(rnd.randint(2, 6))]
+        expr = terms[0]
+        for t in terms[1:]:
+            expr += " %s %s" % (rnd.choice("+-*<"), t)
+        steps.append(expr)
+    return "def chain%d(x y)\n  %s;\n\n" % (i, " :\n  ".join(steps))
+
+
+def mandel(i, rnd):
+    # The ch6 mandelbrot test case scaled up: the plotting driver with
+    # literal-heavy coordinates, and many calls with different windows.
+    calls = "".join(
+        "mandel%d(%.4f, %.4f, %.5f, %.5f);\n"
+        % (i, rnd.uniform(-2.5, 0.5), rnd.uniform(-1.5, 1.5),
+           rnd.uniform(0.001, 0.1), rnd.uniform(0.001, 0.1))
+        for _ in range(20))
+    return (
+        "def mandel%d(realstart imagstart realmag imagmag)\n"
+        "  mandelhelp(realstart, realstart+realmag*78.0, realmag,\n"
+        "             imagstart, imagstart+imagmag*40.0, imagmag);\n%s\n"
+        % (i, calls))
+
+
+def nested(i, rnd):
+    # Deeply nested var and for scopes that shadow the parameters and each
+    # other, with every level reading names bound further out: the binds,
+    # lookups and scope exits codegen does for variables.
+    depth = rnd.randint(24, 40)
+    names = ["x", "y", "acc", "t"]
+    lines = ["def nested%d(x y)" % i, "  var acc = x, t = y in"]
+    for d in range(depth):
+        a, b, c = (rnd.choice(names) for _ in range(3))
+        if rnd.random() < 0.3:
+            lines.append("  for k%d = %s, k%d < %s + 2 in" % (d, a, d, b))
+            names.append("k%d" % d)
+        else:
+            fresh = "v%d" % d
+            lines.append("  var %s = %s * %s + %s, %s = %s - %s in"
+                         % (fresh, a, b, c, rnd.choice(["acc", "t", "x"]), b, c))
+            names.append(fresh)
+    body = " + ".join(rnd.choice(names) for _ in range(8))
+    lines.append("  %s;\n\n" % body)
+    return "\n".join(lines)
+
+
+WORDS = ["lexer", "token", "buffer", "scan", "vector", "kernel", "mask",
+         "identifier", "whitespace", "comment", "stream", "offset"]
+
+SHAPES = {
+    "chains": chains,
+    "commented": commented,
+    "idents": idents,
+    "mandel": mandel,
+    "mixed": mixed,
+    "nested": nested,
+}
+
+PRELUDE = {
+    "chains": "def binary : 1 (x y) y;\n\n",
+    "mixed": "def binary : 1 (x y) y;\n\n",
+}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__,
+                                 formatter_class=argparse.RawTextHelpFormatter)
+    ap.add_argument("--shape", choices=sorted(SHAPES), default="mixed")
+    ap.add_argument("--size", type=float, default=4,
+                    help="approximate output size in MB")
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+
+    rnd = random.Random(args.seed)
+    out = sys.stdout
+    limit = int(args.size * 1024 * 1024)
+    written = out.write(PRELUDE.get(args.shape, ""))
+    i = 0
+    while written < limit:
+        written += out.write(SHAPES[args.shape](i, rnd))
+        i += 1
+
+
+if __name__ == "__main__":
+    main()
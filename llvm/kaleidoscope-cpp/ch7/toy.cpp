@@ -1,32 +1,62 @@
 #include "../include/KaleidoscopeJIT.h"
+#include "../include/KaleidoscopeScan.h"
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <map>
 #include <memory>
+#include <pthread.h>
 #include <string>
+#include <sys/wait.h>
+#include <type_traits>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 using namespace llvm;
@@ -55,238 +85,805 @@ enum Token {
     // operators
     tok_binary = -11, 
     tok_unary = -12,
-    tok_var = -13
+    tok_var = -13,
+
+    // a malformed token; the lexer has already reported it
+    tok_error = -14,
+
+    // REPL command: "load <file>", with the file name in IdentifierSym.  load
+    // is not a keyword; see Lexer::isLoadCommand.
+    tok_load = -15,
+
+    // function qualifier
+    tok_pure = -16
+
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+/// KeywordEntry/Keywords - Every reserved word and the token it lexes to.  To
+/// add a keyword, add its token above and a line here; the lookup table below
+/// is rebuilt from this list at compile time.
+struct KeywordEntry {
+  const char *Spelling;
+  unsigned Length;
+  int Tok;
+};
 
-/// gettok - Return the next token from standard input.
-static int gettok() {
-  static int LastChar = ' ';
+static constexpr unsigned ConstStrLen(const char *S) {
+  return *S ? 1 + ConstStrLen(S + 1) : 0;
+}
 
-  // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = getchar();
+#define KEYWORD(Spelling, Tok) {Spelling, ConstStrLen(Spelling), Tok}
+static constexpr KeywordEntry Keywords[] = {
+    KEYWORD("def", tok_def),       KEYWORD("extern", tok_extern),
+    KEYWORD("if", tok_if),         KEYWORD("then", tok_then),
+    KEYWORD("else", tok_else),     KEYWORD("for", tok_for),
+    KEYWORD("in", tok_in),         KEYWORD("binary", tok_binary),
+    KEYWORD("unary", tok_unary),   KEYWORD("var", tok_var),
+    KEYWORD("pure", tok_pure),
+};
+#undef KEYWORD
 
-  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
-      IdentifierStr += LastChar;
+static constexpr unsigned NumKeywords = sizeof(Keywords) / sizeof(Keywords[0]);
+static constexpr unsigned KeywordTableSize = 64; // power of two, >= 2 * NumKeywords
+static_assert(KeywordTableSize >= 2 * NumKeywords, "grow KeywordTableSize");
 
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "var")
-      return tok_var;
+/// KeywordHash - Hash an identifier by its length and first and last
+/// characters, which is all it takes to tell the keywords apart.
+static constexpr unsigned KeywordHash(unsigned Seed, unsigned Len,
+                                      unsigned char First, unsigned char Last) {
+  return (First + Last * Seed + Len * 7) & (KeywordTableSize - 1);
+}
+
+/// KeywordTable - A perfect hash over Keywords: Slot[KeywordHash(Seed, ...)]
+/// is the index of the only keyword that can have that hash, or -1.
+struct KeywordTable {
+  int Slot[KeywordTableSize];
+  unsigned Seed;
+  unsigned MinLength, MaxLength;
+};
+
+/// BuildKeywordTable - Try seeds until one hashes every keyword to its own
+/// slot.  Seed 0 means none was found, which the static_assert below reports.
+static constexpr KeywordTable BuildKeywordTable() {
+  for (unsigned Seed = 1; Seed < 4096; ++Seed) {
+    KeywordTable T = {{}, Seed, ~0u, 0};
+    for (unsigned i = 0; i < KeywordTableSize; ++i)
+      T.Slot[i] = -1;
+
+    bool Collision = false;
+    for (unsigned i = 0; i < NumKeywords && !Collision; ++i) {
+      const KeywordEntry &K = Keywords[i];
+      unsigned H = KeywordHash(Seed, K.Length, K.Spelling[0],
+                               K.Spelling[K.Length - 1]);
+      Collision = T.Slot[H] != -1;
+      T.Slot[H] = i;
+      T.MinLength = K.Length < T.MinLength ? K.Length : T.MinLength;
+      T.MaxLength = K.Length > T.MaxLength ? K.Length : T.MaxLength;
+    }
+    if (!Collision)
+      return T;
+  }
+  return {{}, 0, 0, 0};
+}
+
+static constexpr KeywordTable KeywordSlots = BuildKeywordTable();
+static_assert(KeywordSlots.Seed != 0,
+              "no perfect hash for Keywords; change KeywordHash");
+
+/// LookupKeyword - Return the keyword token for an identifier, or
+/// tok_identifier, with a single probe of KeywordSlots.
+static int LookupKeyword(const char *Id, unsigned Len) {
+  if (Len < KeywordSlots.MinLength || Len > KeywordSlots.MaxLength)
+    return tok_identifier;
+
+  int Slot = KeywordSlots.Slot[KeywordHash(KeywordSlots.Seed, Len, Id[0],
+                                           Id[Len - 1])];
+  if (Slot < 0)
+    return tok_identifier;
+
+  const KeywordEntry &K = Keywords[Slot];
+  if (K.Length != Len || memcmp(K.Spelling, Id, Len) != 0)
     return tok_identifier;
+  return K.Tok;
+}
+
+/// SourceSpan - Byte range of a token within the source text.
+struct SourceSpan {
+  unsigned Offset = 0;
+  unsigned Length = 0;
+};
+
+namespace {
+
+/// SourceInput - The program text the lexer walks over.  A file named on the
+/// command line is loaded once through llvm::MemoryBuffer (which mmaps it when
+/// it is large enough), so lexing is just a pointer walk.  Standard input is
+/// pulled in a line at a time for the REPL.
+class SourceInput {
+public:
+  enum InputKind { IK_File, IK_Lines };
+
+  bool openFile(llvm::StringRef Path) {
+    auto BufOrErr = llvm::MemoryBuffer::getFile(Path);
+    if (!BufOrErr) {
+      fprintf(stderr, "Error: cannot open '%s': %s\n", Path.str().c_str(),
+              BufOrErr.getError().message().c_str());
+      return false;
+    }
+    Kind = IK_File;
+    File = std::move(*BufOrErr);
+    Text.clear();
+    reset(File->getBufferStart(), File->getBufferEnd(), 0);
+    return true;
+  }
+
+  void openStdin() {
+    Kind = IK_Lines;
+    File.reset();
+    Text.clear();
+    reset(Text.data(), Text.data(), 0);
+  }
+
+  /// peek - Return the character at the cursor without consuming it, pulling
+  /// in more input if needed.  Returns EOF at the end of the input.
+  int peek() {
+    if (CurPtr == BufEnd && !refill())
+      return EOF;
+    return (unsigned char)*CurPtr;
+  }
+
+  void advance() { ++CurPtr; }
+
+  /// skip - Advance the cursor over a run of characters with one of the
+  /// kscan kernels, pulling in more input while the run reaches the end.
+  void skip(const char *(*Kernel)(const char *, const char *)) {
+    while ((CurPtr = Kernel(CurPtr, BufEnd)) == BufEnd && refill())
+      ;
+  }
+
+  unsigned offset() const { return CurPtr - BufStart; }
+
+  /// getText - Return the text of a span.  Only valid until the next refill,
+  /// so callers that keep it must copy it.
+  llvm::StringRef getText(SourceSpan S) const {
+    return llvm::StringRef(BufStart + S.Offset, S.Length);
+  }
+
+private:
+  void reset(const char *Start, const char *End, unsigned Off) {
+    BufStart = Start;
+    BufEnd = End;
+    CurPtr = Start + Off;
+  }
+
+  /// refill - Append more of standard input to Text.  Returns false at EOF or
+  /// when reading from a file, which is always fully loaded.
+  bool refill() {
+    if (Kind == IK_File)
+      return false;
+
+    unsigned Off = offset();
+    char Chunk[4096];
+    if (!fgets(Chunk, sizeof(Chunk), stdin))
+      return false;
+    Text += Chunk;
+    reset(Text.data(), Text.data() + Text.size(), Off);
+    return true;
+  }
+
+  InputKind Kind = IK_Lines;
+  std::unique_ptr<llvm::MemoryBuffer> File;
+  std::string Text; // Everything read so far from stdin.
+  const char *BufStart = nullptr;
+  const char *BufEnd = nullptr;
+  const char *CurPtr = nullptr;
+};
+
+} // end anonymous namespace
+
+/// Symbol - A small integer that stands for an interned identifier.  The
+/// lexer interns every identifier once; from then on the parser, the AST and
+/// the codegen tables pass and compare Symbols instead of strings.
+using Symbol = unsigned;
+
+namespace {
+
+/// WellKnownSymbol - The Symbols every SymbolTable interns first, in this
+/// order, so that they are constants: the parser compares against them
+/// without interning anything, which matters when several threads parse
+/// against one table.  WellKnownNames spells them.
+enum WellKnownSymbol : Symbol {
+  sym_anonymous_expr, // the function a top-level expression is compiled to
+  sym_simd,           // the words of a "for simd" loop
+  sym_width,
+  sym_unroll,
+  sym_load,           // the REPL's load command
+  sym_double,         // the scalar type names
+  sym_float,
+  sym_int,
+  sym_bool,
+  sym_vec2,           // the vector type names, which also construct vectors
+  sym_vec4,
+  sym_vec8,
+  sym_select,         // the vector builtins; see VectorBuiltin
+  sym_hsum,
+  sym_hmin,
+  sym_hmax,
+  sym_any,
+  sym_all,
+  NumWellKnownSymbols
+};
+
+static const char *const WellKnownNames[] = {
+    "__anonymous_expr", "simd", "width", "unroll", "load",
+    "double", "float", "int", "bool", "vec2", "vec4", "vec8",
+    "select", "hsum", "hmin", "hmax", "any", "all"};
+static_assert(sizeof(WellKnownNames) / sizeof(WellKnownNames[0]) ==
+                  NumWellKnownSymbols,
+              "spell every WellKnownSymbol");
+
+/// SymbolTable - Maps identifier spellings to Symbols and back.  Spellings are
+/// copied once into the StringMap's allocator and live as long as the table.
+class SymbolTable {
+public:
+  SymbolTable() {
+    for (const char *Name : WellKnownNames)
+      intern(Name);
+  }
+
+  Symbol intern(llvm::StringRef Name) {
+    auto Ins = Ids.insert(std::make_pair(Name, (Symbol)Names.size()));
+    if (Ins.second)
+      Names.push_back(Ins.first->getKey());
+    return Ins.first->second;
+  }
+
+  llvm::StringRef name(Symbol S) const { return Names[S]; }
+
+  size_t size() const { return Names.size(); }
+
+  /// operatorSymbol - The Symbol naming the function that implements a user
+  /// defined operator, "unary" or "binary" followed by the operator character.
+  Symbol operatorSymbol(bool IsBinary, char Op) {
+    unsigned char C = Op;
+    if (!OperatorInterned[IsBinary][C]) {
+      std::string Name = IsBinary ? "binary" : "unary";
+      Name += Op;
+      OperatorSymbols[IsBinary][C] = intern(Name);
+      OperatorInterned[IsBinary][C] = true;
+    }
+    return OperatorSymbols[IsBinary][C];
+  }
+
+private:
+  llvm::StringMap<Symbol, llvm::BumpPtrAllocator> Ids;
+  std::vector<llvm::StringRef> Names;
+  Symbol OperatorSymbols[2][256];
+  bool OperatorInterned[2][256] = {};
+};
+
+} // end anonymous namespace
+
+namespace {
+
+/// Lexer - The lexer state: the input being read and the results of the last
+/// gettok.  It belongs to one CompilerInstance, and interns identifiers into
+/// that instance's SymbolTable.
+class Lexer {
+public:
+  explicit Lexer(SymbolTable &Symbols) : Symbols(Symbols) {}
+
+  int gettok();
+
+  SourceInput Source;
+  const kscan::ScanKernels *Scan = &kscan::getBestKernels();
+  SourceSpan TokSpan;            // Source range of the last token
+  llvm::StringRef IdentifierStr; // Filled in if tok_identifier
+  Symbol IdentifierSym = 0;      // Filled in if tok_identifier or tok_load
+  double NumVal = 0;             // Filled in if tok_number
+
+private:
+  int lexToken();
+  bool isLoadCommand();
+  void lexLoadPath();
+
+  /// PrevTok - The token gettok returned last; ';' before the first, as a
+  /// statement starts there too.
+  int PrevTok = ';';
+
+  SymbolTable &Symbols;
+};
+
+} // end anonymous namespace
+
+/// ParseNumber - Convert the text of a number token, which is a run of digits
+/// and dots.  Only [0-9]+ ('.' [0-9]*)? and '.' [0-9]+ are valid, so "1.2.3"
+/// and "." are rejected instead of being cut short the way strtod would.  The
+/// text is parsed in place by std::from_chars, which does not allocate and
+/// does not depend on the locale.
+static bool ParseNumber(llvm::StringRef Str, double &Val) {
+  if (Str.count('.') > 1 || Str == ".")
+    return false;
+
+  const char *End = Str.data() + Str.size();
+  std::from_chars_result R =
+      std::from_chars(Str.data(), End, Val, std::chars_format::fixed);
+  return R.ec == std::errc() && R.ptr == End;
+}
+
+/// gettok - Return the next token from the source input.
+int Lexer::gettok() {
+  int Tok = lexToken();
+  PrevTok = Tok;
+  return Tok;
+}
+
+/// lexToken - Lex the next token for gettok.
+int Lexer::lexToken() {
+  // Skip any whitespace.
+  Source.skip(Scan->skipSpace);
+  int LastChar = Source.peek();
+
+  TokSpan.Offset = Source.offset();
+
+  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+    Source.advance();
+    Source.skip(Scan->skipAlnum);
+
+    TokSpan.Length = Source.offset() - TokSpan.Offset;
+    IdentifierStr = Source.getText(TokSpan);
+
+    int Tok = LookupKeyword(IdentifierStr.data(), IdentifierStr.size());
+    if (Tok != tok_identifier)
+      return Tok;
+    IdentifierSym = Symbols.intern(IdentifierStr);
+    if (IdentifierSym == sym_load && isLoadCommand()) {
+      lexLoadPath();
+      return tok_load;
+    }
+    return Tok;
   }
 
   if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-    std::string NumStr;
     do {
-      NumStr += LastChar;
-      LastChar = getchar();
+      Source.advance();
+      LastChar = Source.peek();
     } while (isdigit(LastChar) || LastChar == '.');
 
-    NumVal = strtod(NumStr.c_str(), nullptr);
+    TokSpan.Length = Source.offset() - TokSpan.Offset;
+    llvm::StringRef NumStr = Source.getText(TokSpan);
+    if (!ParseNumber(NumStr, NumVal)) {
+      fprintf(stderr, "Error: malformed number literal '%.*s'\n",
+              (int)NumStr.size(), NumStr.data());
+      return tok_error;
+    }
     return tok_number;
   }
 
   if (LastChar == '#') {
     // Comment until end of line.
-    do
-      LastChar = getchar();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+    Source.advance();
+    Source.skip(Scan->skipLine);
+    LastChar = Source.peek();
 
     if (LastChar != EOF)
-      return gettok();
+      return lexToken();
   }
 
   // Check for end of file.  Don't eat the EOF.
+  TokSpan.Length = 0;
   if (LastChar == EOF)
     return tok_eof;
 
   // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = getchar();
-  return ThisChar;
+  Source.advance();
+  TokSpan.Length = 1;
+  return LastChar;
 }
 
-//===----------------------------------------------------------------------===//
-// Abstract Syntax Tree (aka Parse Tree)
-//===----------------------------------------------------------------------===//
+/// isLoadCommand - Whether the identifier load just lexed is the REPL command:
+/// the first word of a top-level statement, at the start of the input or
+/// after a ';' or another load, and not called as in "load(x)".  Anywhere
+/// else it is an ordinary name.  This is decided here rather than in the
+/// parser because the file name that follows is raw text, not tokens.
+bool Lexer::isLoadCommand() {
+  if (PrevTok != ';' && PrevTok != tok_load)
+    return false;
+  while (Source.peek() == ' ' || Source.peek() == '\t')
+    Source.advance();
+  return Source.peek() != '(';
+}
+
+/// lexLoadPath - The rest of the line after "load", up to a ';', names the file
+/// to load.  It becomes part of the token, interned into IdentifierSym.
+void Lexer::lexLoadPath() {
+  while (Source.peek() == ' ' || Source.peek() == '\t')
+    Source.advance();
 
+  SourceSpan Path = {Source.offset(), 0};
+  for (int C = Source.peek(); C != EOF && C != '\n' && C != '\r' && C != ';';
+       C = Source.peek())
+    Source.advance();
+  Path.Length = Source.offset() - Path.Offset;
+
+  IdentifierSym = Symbols.intern(Source.getText(Path).rtrim());
+  TokSpan.Length = Source.offset() - TokSpan.Offset;
+}
 
 namespace {
 
-/// ExprAST - Base class for all expression nodes.
-class ExprAST {
+/// TokenStream - The tokens of the input laid out contiguously for the
+/// parser, struct-of-arrays style.  Each token is one 32-bit word with its
+/// kind in the low 8 bits and, for identifiers and numbers, an index into
+/// SymPool or NumPool in the upper 24 bits.  The whole input can be lexed up
+/// front (-prelex), or tokens are appended as the parser asks for them, which
+/// is what the REPL needs.  Either way any token can be looked at by index.
+class TokenStream {
 public:
-  virtual ~ExprAST() { };
-  virtual llvm::Value* codegen() = 0;
-};
+  explicit TokenStream(Lexer &Lex) : Lex(Lex) {}
 
-/// NumberExprAST - Expression class for numeric literals like "1.0".
-class NumberExprAST : public ExprAST {
-  double Val;
+  void clear() {
+    Words.clear();
+    NumPool.clear();
+    SymPool.clear();
+    Spans.clear();
+  }
 
-public:
-  NumberExprAST(double Val) : Val(Val) {}
-  virtual llvm::Value* codegen() override;
+  size_t size() const { return Words.size(); }
+
+  /// lexAll - Append every remaining token of the input, up to tok_eof.
+  /// Does nothing once tok_eof is in the stream.
+  void lexAll() {
+    if (!Words.empty() && getKind(Words.size() - 1) == tok_eof)
+      return;
+    while (lexOne() != tok_eof)
+      ;
+  }
+
+  /// fill - Lex on demand until token I exists.
+  void fill(size_t I) {
+    while (I >= Words.size())
+      lexOne();
+  }
+
+  int getKind(size_t I) const { return decodeKind(Words[I]); }
+  Symbol getSymbol(size_t I) const { return SymPool[Words[I] >> 8]; }
+  double getNumber(size_t I) const { return NumPool[Words[I] >> 8]; }
+  SourceSpan getSpan(size_t I) const { return Spans[I]; }
+
+  /// getMemoryUsage - Bytes of token storage, for the -bench=parse report.
+  size_t getMemoryUsage() const {
+    return Words.capacity() * sizeof(Words[0]) +
+           NumPool.capacity() * sizeof(NumPool[0]) +
+           SymPool.capacity() * sizeof(SymPool[0]) +
+           Spans.capacity() * sizeof(Spans[0]);
+  }
+
+private:
+  // ASCII characters are their own kind and tok_* values are stored as
+  // 128 - Tok.  Any other byte is KindOtherChar with the byte as payload.
+  enum : unsigned { KindOtherChar = 255, MaxPayload = (1u << 24) - 1 };
+
+  static int decodeKind(uint32_t W) {
+    unsigned K = W & 0xFF;
+    if (K < 128)
+      return K;
+    if (K == KindOtherChar)
+      return W >> 8;
+    return 128 - (int)K;
+  }
+
+  int lexOne() {
+    int Tok = Lex.gettok();
+    uint32_t Kind, Payload = 0;
+    if (Tok < 0)
+      Kind = 128 - Tok;
+    else if (Tok < 128)
+      Kind = Tok;
+    else {
+      Kind = KindOtherChar;
+      Payload = Tok;
+    }
+
+    if (Tok == tok_identifier || Tok == tok_load) {
+      Payload = SymPool.size();
+      SymPool.push_back(Lex.IdentifierSym);
+    } else if (Tok == tok_number) {
+      Payload = NumPool.size();
+      NumPool.push_back(Lex.NumVal);
+    }
+    if (Payload > MaxPayload)
+      llvm::report_fatal_error("too many identifiers or numbers in one input");
+
+    Words.push_back(Kind | Payload << 8);
+    Spans.push_back(Lex.TokSpan);
+    return Tok;
+  }
+
+  Lexer &Lex;
+  std::vector<uint32_t> Words;
+  std::vector<double> NumPool;
+  std::vector<Symbol> SymPool;
+  std::vector<SourceSpan> Spans;
 };
 
-/// VariableExprAST - Expression class for referencing a variable, like "a".
-class VariableExprAST : public ExprAST {
-  std::string Name;
+} // end anonymous namespace
+
+//===----------------------------------------------------------------------===//
+// Abstract Syntax Tree (aka Parse Tree)
+//===----------------------------------------------------------------------===//
+
 
-public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
-  virtual llvm::Value* codegen() override;
-  const std::string& getName() const { return Name; }
+/// ExprIdx - A reference to an expression node: its index in the ExprPool of
+/// the function body it belongs to.  NoExpr stands for "no expression", such
+/// as a for loop without a step, and is also what the parser returns when an
+/// expression fails to parse.
+using ExprIdx = uint32_t;
+static const ExprIdx NoExpr = ~0u;
+
+/// ExprKind - What an ExprNode is, and so how to read its operands.
+enum ExprKind : uint8_t {
+  EK_Number,   // A: index into the pool's numbers
+  EK_Variable, // A: variable name
+  EK_Unary,    // Op; A: operand
+  EK_Binary,   // Op; A: LHS, B: RHS
+  EK_Call,     // A: callee; B, C: first and count of the arguments in Extra
+  EK_If,       // A: condition, B: then, C: else
+  EK_For,      // Op: its ValueType; A: loop variable;
+               // Extra[B..B+3]: start, end, step, body; C: its LoopHints
+  EK_Var,      // Extra[A..A+3*B]: (name, initializer, ValueType); C: body
+  EK_Index,    // A: array or vector variable, B: index
+  EK_Vector,   // Op: lanes; A, B: first and count of the elements in Extra
 };
 
-class UnaryExprAST : public ExprAST {
-  char Op;
-  std::unique_ptr<ExprAST> Operand;
+/// ValueType - The type a variable, parameter or result is declared with, as
+/// in "x : int".  Whatever is not annotated is a double.
+enum ValueType : uint8_t {
+  VT_Double, // double
+  VT_Float,  // float, 32 bits
+  VT_Int,    // i64
+  VT_Bool,   // i1
+  // Arrays of the above, as in "x : float[]": a pointer to the first element.
+  VT_DoubleArray,
+  VT_FloatArray,
+  VT_IntArray,
+  VT_BoolArray,
+  // Vectors of 2, 4 and 8 doubles, as in "x : vec4", operated on lane by lane.
+  VT_Vec2,
+  VT_Vec4,
+  VT_Vec8,
+};
 
-public:
-  UnaryExprAST(char Op,
-               std::unique_ptr<ExprAST> Operand)
-      : Op(Op), Operand(std::move(Operand)) {}
+/// ArrayOf - The type of an array of Ty.
+inline ValueType ArrayOf(ValueType Ty) {
+  return ValueType(Ty + VT_DoubleArray);
+}
+
+/// isArrayType - Whether Ty is one of the array types.
+inline bool isArrayType(ValueType Ty) {
+  return Ty >= VT_DoubleArray && Ty < VT_Vec2;
+}
 
-  virtual llvm::Value* codegen() override;
+/// isVectorType - Whether Ty is one of the vector types.
+inline bool isVectorType(ValueType Ty) { return Ty >= VT_Vec2; }
+
+/// LoopHints - What a "for simd" loop asks of the vectorizer, packed into the
+/// C of its EK_For: Simd, and the Width and Unroll it gave, 0 where it gave
+/// none.  A plain for loop packs to 0.
+struct LoopHints {
+  bool Simd = false;
+  unsigned Width = 0, Unroll = 0;
+
+  uint32_t pack() const { return Simd | Width << 8 | Unroll << 16; }
+  static LoopHints unpack(uint32_t C) {
+    LoopHints H;
+    H.Simd = C & 1;
+    H.Width = (C >> 8) & 0xff;
+    H.Unroll = (C >> 16) & 0xff;
+    return H;
+  }
 };
 
-class BinaryExprAST : public ExprAST {
+/// ExprNode - One expression node.  Every kind fits in the same 16 bytes, so
+/// a function body is one contiguous array of them; A, B and C hold symbols,
+/// child indices or indices into the pool's side tables as listed above.
+struct ExprNode {
+  ExprKind Kind;
   char Op;
-  std::unique_ptr<ExprAST> LHS, RHS;
+  uint32_t A, B, C;
+};
 
-public:
-  BinaryExprAST(char Op,
-		        std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+static_assert(sizeof(ExprNode) == 16, "keep ExprNode small");
 
-  virtual llvm::Value* codegen() override;
-};
+namespace {
 
-class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST> > Args;
+class CodeGen;
 
+/// ExprPool - The expressions of one function body.  Nodes are appended as
+/// the parser finishes them, so children always come before their parents,
+/// and are only ever freed all together with the pool.  Argument lists, the
+/// parts of a for loop and var bindings go in Extra; number literals go in
+/// Numbers.
+class ExprPool {
 public:
-  CallExprAST(const std::string& callee,
-              std::vector<std::unique_ptr<ExprAST> > args)
-      : Callee(callee), Args(std::move(args)) { }
-  virtual llvm::Value* codegen() override;
-};
+  ExprIdx add(ExprKind Kind, char Op, uint32_t A, uint32_t B = 0,
+              uint32_t C = 0) {
+    Nodes.push_back({Kind, Op, A, B, C});
+    return Nodes.size() - 1;
+  }
 
-class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> Cond;
-    std::unique_ptr<ExprAST> Then;
-    std::unique_ptr<ExprAST> Else;
+  ExprIdx addNumber(double Val) {
+    Numbers.push_back(Val);
+    return add(EK_Number, 0, Numbers.size() - 1);
+  }
 
-  public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond,
-              std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else)
-        : Cond(std::move(Cond)),
-          Then(std::move(Then)),
-          Else(std::move(Else)) { }
+  /// addExtra - Append a list of operands to Extra, returning where it starts.
+  uint32_t addExtra(llvm::ArrayRef<uint32_t> Vals) {
+    uint32_t First = Extra.size();
+    Extra.insert(Extra.end(), Vals.begin(), Vals.end());
+    return First;
+  }
 
-    virtual llvm::Value* codegen() override;
-};
+  const ExprNode& operator[](ExprIdx E) const { return Nodes[E]; }
 
-class ForExprAST : public ExprAST {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start;
-    std::unique_ptr<ExprAST> End;
-    std::unique_ptr<ExprAST> Step;
-    std::unique_ptr<ExprAST> Body;
-
-  public:
-    ForExprAST(const std::string& VarName,
-               std::unique_ptr<ExprAST> Start,
-               std::unique_ptr<ExprAST> End,
-               std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body)
-        : VarName(VarName),
-          Start(std::move(Start)),
-          End(std::move(End)),
-          Step(std::move(Step)),
-          Body(std::move(Body)) { }
-
-    virtual llvm::Value* codegen() override;
-};
+  /// setNumber - Turn node E into the number Val.
+  void setNumber(ExprIdx E, double Val) {
+    Numbers.push_back(Val);
+    Nodes[E] = {EK_Number, 0, uint32_t(Numbers.size() - 1), 0, 0};
+  }
+
+  /// replaceWith - Overwrite node E with node By, so that E computes what By
+  /// does and the parent of E need not change.
+  void replaceWith(ExprIdx E, ExprIdx By) { Nodes[E] = Nodes[By]; }
+  double getNumber(const ExprNode& N) const { return Numbers[N.A]; }
+  llvm::ArrayRef<uint32_t> getExtra(uint32_t First, uint32_t Count) const {
+    return llvm::makeArrayRef(Extra).slice(First, Count);
+  }
+
+  size_t size() const { return Nodes.size(); }
+
+  void clear() {
+    Nodes.clear();
+    Extra.clear();
+    Numbers.clear();
+  }
+
+  /// reserveLike - Make room for as much as Other holds.  The parser sizes
+  /// each new body like the last one, so a typical body is built without
+  /// regrowing its vectors.
+  void reserveLike(const ExprPool& Other) {
+    Nodes.reserve(Other.Nodes.size());
+    Extra.reserve(Other.Extra.size());
+    Numbers.reserve(Other.Numbers.size());
+  }
+
+  /// isIdenticalTo - Whether Other holds exactly the same expressions.
+  bool isIdenticalTo(const ExprPool& Other) const {
+    auto SameNode = [](const ExprNode& L, const ExprNode& R) {
+      return L.Kind == R.Kind && L.Op == R.Op && L.A == R.A && L.B == R.B &&
+             L.C == R.C;
+    };
+    return std::equal(Nodes.begin(), Nodes.end(), Other.Nodes.begin(),
+                      Other.Nodes.end(), SameNode) &&
+           Extra == Other.Extra && Numbers == Other.Numbers;
+  }
+
+  /// getMemoryUsage - Bytes used by the nodes and side tables.
+  size_t getMemoryUsage() const {
+    return Nodes.size() * sizeof(ExprNode) + Extra.size() * sizeof(uint32_t) +
+           Numbers.size() * sizeof(double);
+  }
 
-class VarExprAST : public ExprAST {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST> > > VarNames;
-    std::unique_ptr<ExprAST> Body;
+private:
+  std::vector<ExprNode> Nodes;
+  std::vector<uint32_t> Extra;
+  std::vector<double> Numbers;
+};
 
-  public:
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST> > > VarNames,
-               std::unique_ptr<ExprAST> Body)
-        : VarNames(std::move(VarNames)), Body(std::move(Body)) { }
+/// ExprVisitor - Dispatch on the kind of an expression node with a switch, in
+/// the style of llvm::InstVisitor.  SubClass provides visitNumber,
+/// visitVariable, ... visitVector, each taking the node.  Codegen is one
+/// visitor; an analysis over a function body is written as another.
+template <typename SubClass, typename RetTy> class ExprVisitor {
+public:
+  explicit ExprVisitor(const ExprPool& Pool) : Pool(Pool) {}
+
+  RetTy visit(ExprIdx E) {
+    SubClass* S = static_cast<SubClass*>(this);
+    ExprNode N = Pool[E];
+    switch (N.Kind) {
+      case EK_Number:   return S->visitNumber(N);
+      case EK_Variable: return S->visitVariable(N);
+      case EK_Unary:    return S->visitUnary(N);
+      case EK_Binary:   return S->visitBinary(N);
+      case EK_Call:     return S->visitCall(N);
+      case EK_If:       return S->visitIf(N);
+      case EK_For:      return S->visitFor(N);
+      case EK_Var:      return S->visitVar(N);
+      case EK_Index:    return S->visitIndex(N);
+      case EK_Vector:   return S->visitVector(N);
+    }
+    llvm_unreachable("unknown expression kind");
+  }
 
-    virtual llvm::Value* codegen() override;
+protected:
+  const ExprPool& Pool;
 };
 
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
+  Symbol Name;
+  std::vector<Symbol> Args;
   bool IsOperator;
   unsigned Precedence;
+  bool Pure;
+  std::vector<ValueType> ArgTypes;
+  ValueType ReturnType;
+  std::vector<int> ArgLengths;
 
 public:
-  PrototypeAST(const std::string& name,
-               std::vector<std::string> Args,
+  PrototypeAST(Symbol name,
+               std::vector<Symbol> Args,
                bool IsOperator = false,
-               unsigned Precedence = 0)
-      : Name(name), 
+               unsigned Precedence = 0,
+               bool Pure = false,
+               std::vector<ValueType> ArgTypes = {},
+               ValueType ReturnType = VT_Double,
+               std::vector<int> ArgLengths = {})
+      : Name(name),
         Args(std::move(Args)),
         IsOperator(IsOperator),
-        Precedence(Precedence) { }
+        Precedence(Precedence),
+        Pure(Pure),
+        ArgTypes(std::move(ArgTypes)),
+        ReturnType(ReturnType),
+        ArgLengths(std::move(ArgLengths)) {
+    this->ArgTypes.resize(this->Args.size(), VT_Double);
+    this->ArgLengths.resize(this->Args.size(), -1);
+  }
 
-  const std::string& getName() const { return Name; }
+  Symbol getName() const { return Name; }
+  const std::vector<Symbol>& getArgs() const { return Args; }
+  const std::vector<ValueType>& getArgTypes() const { return ArgTypes; }
+  ValueType getReturnType() const { return ReturnType; }
 
-  llvm::Function* codegen();
+  /// getArgLengths - For each parameter that is an array declared with a
+  /// length, as in "a : float[n]", the index of the parameter holding that
+  /// length; -1 for the others.
+  const std::vector<int>& getArgLengths() const { return ArgLengths; }
+
+  llvm::Function* codegen(CodeGen& CG);
 
   bool isUnaryOp()  const { return IsOperator && Args.size() == 1; }
   bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
-  char getOperatorName() const { 
+  char getOperatorName(const SymbolTable& Symbols) const {
       assert(isUnaryOp() || isBinaryOp());
-      return Name[Name.size() - 1];
+      return Symbols.name(Name).back();
   }
 
   unsigned getBinaryPrecedence() const { return Precedence; }
+
+  /// isPure - Declared "pure": the result depends only on the arguments, and
+  /// the call has no other effect and always returns.
+  bool isPure() const { return Pure; }
 };
 
+/// FunctionAST - A function definition, or a top-level expression wrapped in
+/// an anonymous function.  It owns the pool its body's nodes live in.
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExprAST> Body;
+  ExprPool Pool;
+  ExprIdx Body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) { }
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprPool Pool, ExprIdx Body)
+      : Proto(std::move(Proto)), Pool(std::move(Pool)), Body(Body) { }
 
-  llvm::Function* codegen();
+  const PrototypeAST& getProto() const { return *Proto; }
+  const ExprPool& getPool() const { return Pool; }
+  ExprIdx getBody() const { return Body; }
+
+  llvm::Function* codegen(CodeGen& CG);
 };
 
 } // end anonymous namespace
@@ -295,38 +892,52 @@ public:
 // Parser
 //===----------------------------------------------------------------------===//
 
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
-static int getNextToken() { return CurTok = gettok(); }
-
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence = {
-    {'=', 2},
-    {'<', 10},
-    {'+', 20},
-    {'-', 20},
-    {'*', 40},
-};
+namespace {
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
+/// PrecedenceTable - This holds the precedence for each binary operator that
+/// is defined, in a flat array indexed by the operator character, so the
+/// lookup ParseBinOpRHS does after every operand is a single load.  0 means
+/// the character is not a binary operator.  Each CompilerInstance starts with
+/// the built-in operators and adds its user defined ones to its own table.
+class PrecedenceTable {
+public:
+    PrecedenceTable() {
+        set('=', 2);
+        set('<', 10);
+        set('+', 20);
+        set('-', 20);
+        set('*', 40);
+    }
 
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0)
-        return -1;
+    /// get - The precedence of token Tok, or 0 if it is not a binary operator.
+    int get(int Tok) const {
+        return (unsigned)Tok < 256 ? Prec[Tok] : 0;
+    }
 
-    return TokPrec;
-}
+    /// set - Give Op the precedence P (1..100, or 0 to remove it), returning
+    /// the precedence it had so a failed definition can put it back.
+    int set(char Op, int P) {
+        unsigned char C = Op;
+        int Old = Prec[C];
+        Prec[C] = P;
+        return Old;
+    }
+
+private:
+    unsigned char Prec[256] = {};
+};
+
+} // end anonymous namespace
+
+/// QuietErrors - Set on the threads of a ParallelParser.  An item that fails
+/// to parse there is parsed again on the main thread, which reports the error.
+static thread_local bool QuietErrors = false;
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char* str) {
-    fprintf(stderr, "Error: %s\n", str);
-    return nullptr;
+ExprIdx LogError(const char* str) {
+    if (!QuietErrors)
+        fprintf(stderr, "Error: %s\n", str);
+    return NoExpr;
 }
 
 std::unique_ptr<PrototypeAST> LogErrorP(const char* str) {
@@ -334,52 +945,238 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char* str) {
     return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+namespace {
+
+/// Parser - A recursive descent parser over a TokenStream.  CurTok is the
+/// current token the parser is looking at.  getNextToken steps to the next
+/// token in Tokens, lexing it first if the input was not lexed up front, and
+/// updates CurTok, IdentifierSym and NumVal with its results.
+class Parser {
+public:
+    Parser(TokenStream& Tokens, SymbolTable& Symbols,
+           PrecedenceTable& BinopPrecedence)
+        : Tokens(Tokens), Symbols(Symbols), BinopPrecedence(BinopPrecedence) { }
+
+    int CurTok = 0;
+    int getNextToken();
+
+    /// reset - Start the parser over on a newly opened input.
+    void reset() {
+        Tokens.clear();
+        NextTokIdx = 0;
+        EndTokIdx = SIZE_MAX;
+    }
+
+    /// seek - Carry on parsing at token TokIdx, which must have been lexed,
+    /// reading token EndIdx and everything after it as tok_eof.
+    void seek(size_t TokIdx, size_t EndIdx = SIZE_MAX) {
+        NextTokIdx = TokIdx;
+        EndTokIdx = EndIdx;
+        getNextToken();
+    }
+
+    /// getTokIdx - Where CurTok is in the token stream.
+    size_t getTokIdx() const { return NextTokIdx - 1; }
+
+    std::unique_ptr<FunctionAST> ParseDefinition();
+    std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    std::unique_ptr<PrototypeAST> ParseExtern();
+
+private:
+    /// finishFunction - Hand the nodes parsed so far over to a new FunctionAST,
+    /// and start the next item with room for as many.  Items that fail to
+    /// parse leave their nodes behind to be cleared when the next one starts.
+    std::unique_ptr<FunctionAST> finishFunction(
+        std::unique_ptr<PrototypeAST> Proto, ExprIdx Body) {
+        ExprPool Next;
+        Next.reserveLike(Pool);
+        auto F = std::make_unique<FunctionAST>(std::move(Proto), std::move(Pool), Body);
+        Pool = std::move(Next);
+        return F;
+    }
+
+    int GetTokPrecedence();
+    int peekToken();
+    bool peekTypeName(ValueType& Ty);
+    bool ParseTypeAnnotation(ValueType& Ty,
+                             llvm::Optional<Symbol>* Length = nullptr);
+    ExprIdx ParserNumberExpr();
+    ExprIdx ParseParenExpr();
+    ExprIdx ParseIdentifierExpr();
+    ExprIdx ParseIfExpr();
+    ExprIdx ParseForExpr();
+    ExprIdx ParseVarExpr();
+    ExprIdx ParseVectorExpr(unsigned Lanes);
+    ExprIdx ParsePrimary();
+    ExprIdx ParseUnary();
+    ExprIdx ParseBinOpRHS(int ExprPrec, ExprIdx LHS);
+    ExprIdx ParseExpression();
+    std::unique_ptr<PrototypeAST> ParsePrototype();
+
+    TokenStream& Tokens;
+    SymbolTable& Symbols;
+    PrecedenceTable& BinopPrecedence;
+    ExprPool Pool;
+    size_t NextTokIdx = 0;
+    size_t EndTokIdx = SIZE_MAX;
+    Symbol IdentifierSym = 0; // Filled in if tok_identifier
+    double NumVal = 0;        // Filled in if tok_number
+};
+
+} // end anonymous namespace
+
+int Parser::getNextToken() {
+    size_t I = NextTokIdx++;
+    if (I >= EndTokIdx)
+        return CurTok = tok_eof;
+    Tokens.fill(I);
+    CurTok = Tokens.getKind(I);
+    if (CurTok == tok_identifier)
+        IdentifierSym = Tokens.getSymbol(I);
+    else if (CurTok == tok_number)
+        NumVal = Tokens.getNumber(I);
+    return CurTok;
+}
+
+/// peekToken - The token after CurTok, without moving on to it.
+int Parser::peekToken() {
+    if (NextTokIdx >= EndTokIdx)
+        return tok_eof;
+    Tokens.fill(NextTokIdx);
+    return Tokens.getKind(NextTokIdx);
+}
+
+/// TypeOfName - Set Ty to the type that the identifier Sym names.  Returns
+/// false if it is not a type name.  Type names are not keywords, so this is
+/// only asked where a type may appear.
+static bool TypeOfName(Symbol Sym, ValueType& Ty) {
+    switch (Sym) {
+        case sym_double: Ty = VT_Double; return true;
+        case sym_float:  Ty = VT_Float;  return true;
+        case sym_int:    Ty = VT_Int;    return true;
+        case sym_bool:   Ty = VT_Bool;   return true;
+        case sym_vec2:   Ty = VT_Vec2;   return true;
+        case sym_vec4:   Ty = VT_Vec4;   return true;
+        case sym_vec8:   Ty = VT_Vec8;   return true;
+        default:         return false;
+    }
+}
+
+/// peekTypeName - Whether the token after CurTok names a type; if so, Ty is
+/// set to it.
+bool Parser::peekTypeName(ValueType& Ty) {
+    return peekToken() == tok_identifier &&
+           TypeOfName(Tokens.getSymbol(NextTokIdx), Ty);
+}
+
+/// typeannotation ::= (':' type)?
+/// type ::= ('double' | 'float' | 'int' | 'bool') ('[' identifier? ']')?
+///      ::= 'vec2' | 'vec4' | 'vec8'
+/// Without an annotation Ty is double.  "float[]" is an array of floats.
+/// Where Length is given, as for parameters, "float[n]" is one whose length
+/// is n, which Length is set to.  There are no arrays of vectors.
+bool Parser::ParseTypeAnnotation(ValueType& Ty, llvm::Optional<Symbol>* Length) {
+    Ty = VT_Double;
+    if (CurTok != ':')
+        return true;
+    getNextToken(); // eat :
+
+    if (CurTok != tok_identifier || !TypeOfName(IdentifierSym, Ty)) {
+        LogError("expected a type after ':'");
+        return false;
+    }
+    getNextToken(); // eat the type
+    if (CurTok != '[')
+        return true;
+    if (isVectorType(Ty)) {
+        LogError("there are no arrays of vectors");
+        return false;
+    }
+
+    getNextToken(); // eat [
+    Ty = ArrayOf(Ty);
+    if (Length && CurTok == tok_identifier) {
+        *Length = IdentifierSym;
+        getNextToken(); // eat the length
+    }
+    if (CurTok != ']') {
+        LogError("expected ']' in array type");
+        return false;
+    }
+    getNextToken(); // eat ]
+    return true;
+}
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+int Parser::GetTokPrecedence() {
+    int TokPrec = BinopPrecedence.get(CurTok);
+    if (TokPrec <= 0)
+        return -1;
+
+    return TokPrec;
+}
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParserNumberExpr() {
-    std::unique_ptr<NumberExprAST> result = std::make_unique<NumberExprAST>(NumVal);
+ExprIdx Parser::ParserNumberExpr() {
+    ExprIdx result = Pool.addNumber(NumVal);
     getNextToken();
-    return std::move(result);
+    return result;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprIdx Parser::ParseParenExpr() {
     getNextToken(); // eat (
-    std::unique_ptr<ExprAST> V = ParseExpression();
-    if (!V)
-        return nullptr;
+    ExprIdx V = ParseExpression();
+    if (V == NoExpr)
+        return NoExpr;
 
     if (CurTok != ')')
         return LogError("expected ')'");
 
     getNextToken(); // eat )
-    return std::move(V);
+    return V;
 }
 
 /// identifierexpr
 ///   ::= identifier
 ///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string name = IdentifierStr;
+///   ::= identifier '[' expression ']'
+///   ::= vectorexpr
+ExprIdx Parser::ParseIdentifierExpr() {
+    Symbol name = IdentifierSym;
 
     getNextToken();
 
+    if (CurTok == '[') {
+        getNextToken(); // eat [
+        ExprIdx Index = ParseExpression();
+        if (Index == NoExpr)
+            return NoExpr;
+        if (CurTok != ']')
+            return LogError("expected ']'");
+        getNextToken(); // eat ]
+        return Pool.add(EK_Index, 0, name, Index);
+    }
+
     if (CurTok != '(') // Simple variable ref.
-        return std::make_unique<VariableExprAST>(name);
+        return Pool.add(EK_Variable, 0, name);
+
+    ValueType VecTy;
+    if (TypeOfName(name, VecTy) && isVectorType(VecTy))
+        return ParseVectorExpr(VecTy == VT_Vec2 ? 2 : VecTy == VT_Vec4 ? 4 : 8);
 
     // function call
     getNextToken();
-    std::vector<std::unique_ptr<ExprAST> > Args;
+    llvm::SmallVector<uint32_t, 8> Args;
 
     if (CurTok != ')') {
         // not empty args
         while (true) {
-            std::unique_ptr<ExprAST> Arg = ParseExpression();
-            if (Arg)
-                Args.push_back(std::move(Arg));
+            ExprIdx Arg = ParseExpression();
+            if (Arg != NoExpr)
+                Args.push_back(Arg);
             else
-                return nullptr;
+                return NoExpr;
 
             if (CurTok == ')')
                 break;
@@ -393,116 +1190,153 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 
     getNextToken();
     
-    return std::make_unique<CallExprAST>(name, std::move(Args));
+    return Pool.add(EK_Call, 0, name, Pool.addExtra(Args), Args.size());
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-std::unique_ptr<ExprAST> ParseIfExpr() {
+ExprIdx Parser::ParseIfExpr() {
     getNextToken(); // eat if
 
-    std::unique_ptr<ExprAST> Cond = ParseExpression();
-    if (!Cond)
-        return nullptr;
+    ExprIdx Cond = ParseExpression();
+    if (Cond == NoExpr)
+        return NoExpr;
 
     if (CurTok != tok_then)
         return LogError("Except then");
 
     getNextToken(); // eat then
 
-    std::unique_ptr<ExprAST> Then = ParseExpression();
-    if (!Then)
-        return nullptr;    
+    ExprIdx Then = ParseExpression();
+    if (Then == NoExpr)
+        return NoExpr;    
 
     if (CurTok != tok_else)
         return LogError("Except else");
 
     getNextToken(); // eat else
 
-    std::unique_ptr<ExprAST> Else = ParseExpression();
-    if (!Then)
-        return nullptr;
+    ExprIdx Else = ParseExpression();
+    if (Else == NoExpr)
+        return NoExpr;
 
-    return std::make_unique<IfExprAST>(std::move(Cond),
-                                       std::move(Then),
-                                       std::move(Else));
+    return Pool.add(EK_If, 0, Cond, Then, Else);
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
+/// forexpr ::= 'for' 'simd'? identifier typeannotation '=' expr ',' expr
+///             (',' expr)? loophint* 'in' expression
+/// loophint ::= ('width' | 'unroll') number
+/// "for simd" promises that no iteration depends on another, so they may run
+/// side by side in vectors: width iterations to a vector, a power of two,
+/// and unroll vectors to each trip round the loop.  Only a simd loop takes
+/// hints.
+ExprIdx Parser::ParseForExpr() {
     getNextToken(); // eat for
 
     if (CurTok != tok_identifier)
         return LogError("expected identifier after for");
     
-    std::string VarName = IdentifierStr;
+    Symbol VarName = IdentifierSym;
     getNextToken(); // eat identifier
 
+    // simd, width and unroll are not keywords: "for simd = ..." counts in a
+    // variable called simd.
+    LoopHints Hints;
+    if (VarName == sym_simd && CurTok == tok_identifier) {
+        Hints.Simd = true;
+        VarName = IdentifierSym;
+        getNextToken(); // eat identifier
+    }
+
+    ValueType VarType;
+    if (!ParseTypeAnnotation(VarType))
+        return NoExpr;
+    if (VarType > VT_Bool)
+        return LogError("a for loop counts in a number, not an array or vector");
+
     if (CurTok != '=')
         return LogError("expected '=' after for");
     getNextToken(); // eat =
 
-    std::unique_ptr<ExprAST> Start = ParseExpression();
-    if (!Start)
-        return nullptr;
+    ExprIdx Start = ParseExpression();
+    if (Start == NoExpr)
+        return NoExpr;
 
     if (CurTok != ',')
         return LogError("expected ',' after for start value");
     getNextToken(); // eat ,
 
-    std::unique_ptr<ExprAST> End = ParseExpression();
-    if (!End)
-        return nullptr;
+    ExprIdx End = ParseExpression();
+    if (End == NoExpr)
+        return NoExpr;
 
-    std::unique_ptr<ExprAST> Step;
+    ExprIdx Step = NoExpr;
     if (CurTok == ',') {
         getNextToken(); // eat ,
         Step = ParseExpression();
-        if (!Step)
-            return nullptr;
+        if (Step == NoExpr)
+            return NoExpr;
+    }
+
+    while (Hints.Simd && CurTok == tok_identifier &&
+           (IdentifierSym == sym_width || IdentifierSym == sym_unroll)) {
+        bool IsWidth = IdentifierSym == sym_width;
+        getNextToken(); // eat width or unroll
+        unsigned Max = IsWidth ? 64 : 16;
+        if (CurTok != tok_number || NumVal != std::trunc(NumVal) || NumVal < 1 ||
+            NumVal > Max)
+            return LogError(IsWidth ? "expected a width from 1 to 64"
+                                    : "expected an unroll count from 1 to 16");
+        unsigned N = NumVal;
+        if (IsWidth && (N & (N - 1)))
+            return LogError("a simd width must be a power of two");
+        (IsWidth ? Hints.Width : Hints.Unroll) = N;
+        getNextToken(); // eat the number
     }
 
     if (CurTok != tok_in)
         return LogError("expected 'in' after for");
     getNextToken(); // eat 'in'.       
 
-    std::unique_ptr<ExprAST> Body = ParseExpression();
-    if (!Body)
-        return nullptr;
+    ExprIdx Body = ParseExpression();
+    if (Body == NoExpr)
+        return NoExpr;
 
-    return std::make_unique<ForExprAST>(
-        VarName,
-        std::move(Start),
-        std::move(End),
-        std::move(Step),
-        std::move(Body)
-    );
+    return Pool.add(EK_For, VarType, VarName,
+                    Pool.addExtra({Start, End, Step, Body}), Hints.pack());
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr() {
+/// varexpr ::= 'var' identifier typeannotation ('=' expression)?
+//                    (',' identifier typeannotation ('=' expression)?)*
+//                    'in' expression
+ExprIdx Parser::ParseVarExpr() {
     getNextToken(); // eat var
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST> > > VarNames;
+    llvm::SmallVector<uint32_t, 8> VarNames;
 
     // At least one variable name is required.
     if (CurTok != tok_identifier)
         return LogError("expected identifier after var");
 
     while (true) {
-        std::string Name = IdentifierStr;
+        Symbol Name = IdentifierSym;
         getNextToken();
 
-        std::unique_ptr<ExprAST> Init = nullptr;
+        ValueType Type;
+        if (!ParseTypeAnnotation(Type))
+            return NoExpr;
+
+        ExprIdx Init = NoExpr;
         if (CurTok == '=') {
             getNextToken();
 
             Init = ParseExpression();
-            if (!Init)
-                return nullptr;
+            if (Init == NoExpr)
+                return NoExpr;
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarNames.push_back(Name);
+        VarNames.push_back(Init);
+        VarNames.push_back(Type);
 
         if (CurTok != ',')
             break;
@@ -517,23 +1351,49 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
         return LogError("expected 'in' keyword after 'var'");
     getNextToken(); // eat in
 
-    std::unique_ptr<ExprAST> Body = ParseExpression();
-    if (!Body)
-        return nullptr;
+    ExprIdx Body = ParseExpression();
+    if (Body == NoExpr)
+        return NoExpr;
 
-    return std::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    return Pool.add(EK_Var, 0, Pool.addExtra(VarNames), VarNames.size() / 3,
+                    Body);
 }
 
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
-    switch (CurTok) {
-        case tok_identifier:
-            return ParseIdentifierExpr();
-        case tok_number:
-            return ParserNumberExpr();
+/// vectorexpr ::= ('vec2' | 'vec4' | 'vec8') '(' expression (',' expression)* ')'
+/// Called with the type name eaten.  One element is broadcast to every lane;
+/// otherwise there is one per lane.
+ExprIdx Parser::ParseVectorExpr(unsigned Lanes) {
+    getNextToken(); // eat (
+
+    llvm::SmallVector<uint32_t, 8> Elts;
+    while (true) {
+        ExprIdx Elt = ParseExpression();
+        if (Elt == NoExpr)
+            return NoExpr;
+        Elts.push_back(Elt);
+        if (CurTok == ')')
+            break;
+        if (CurTok != ',')
+            return LogError("Expected ')' or ',' in vector");
+        getNextToken();
+    }
+    getNextToken(); // eat )
+
+    if (Elts.size() != 1 && Elts.size() != Lanes)
+        return LogError("a vector takes one element, or one for each lane");
+    return Pool.add(EK_Vector, Lanes, Pool.addExtra(Elts), Elts.size());
+}
+
+/// primary
+///   ::= identifierexpr
+///   ::= numberexpr
+///   ::= parenexpr
+ExprIdx Parser::ParsePrimary() {
+    switch (CurTok) {
+        case tok_identifier:
+            return ParseIdentifierExpr();
+        case tok_number:
+            return ParserNumberExpr();
         case tok_if:
             return ParseIfExpr();
         case tok_for:
@@ -542,6 +1402,8 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
             return ParseVarExpr();
         case '(':
             return ParseParenExpr();
+        case tok_error: // Already reported by the lexer.
+            return NoExpr;
         default:
             char buf[128];
             sprintf(buf, "unknown token when expecting an expression: '%c'", (char)CurTok);
@@ -549,20 +1411,19 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     }
 }
 
-static std::unique_ptr<ExprAST> ParseUnary() {
+ExprIdx Parser::ParseUnary() {
     if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
         return ParsePrimary();
     
     int Op = CurTok;
     getNextToken();
-    std::unique_ptr<ExprAST> Operand = ParseUnary();
-    if (!Operand)
-        return nullptr;
-    return std::make_unique<UnaryExprAST>(Op, std::move(Operand));
+    ExprIdx Operand = ParseUnary();
+    if (Operand == NoExpr)
+        return NoExpr;
+    return Pool.add(EK_Unary, Op, Operand);
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+ExprIdx Parser::ParseBinOpRHS(int ExprPrec, ExprIdx LHS) {
     while (true) {
         int TokPrec = GetTokPrecedence();
 
@@ -577,50 +1438,59 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
         getNextToken();
 
         auto RHS = ParseUnary();
-        if (!RHS)
-            return nullptr;
+        if (RHS == NoExpr)
+            return NoExpr;
 
         int NextPrec = GetTokPrecedence();
         if (NextPrec > TokPrec)
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
+            RHS = ParseBinOpRHS(TokPrec + 1, RHS);
+            if (RHS == NoExpr)
+                return NoExpr;
 
-        LHS = std::make_unique<BinaryExprAST>(BinOp, 
-                                              std::move(LHS),
-                                              std::move(RHS));
+        LHS = Pool.add(EK_Binary, BinOp, LHS, RHS);
     }
 }
 
 /// expression
 ///   ::= primary binoprhs
 ///
-static std::unique_ptr<ExprAST> ParseExpression() {
+ExprIdx Parser::ParseExpression() {
     auto LHS = ParseUnary();
-    if (!LHS)
-        return nullptr;
+    if (LHS == NoExpr)
+        return NoExpr;
 
-    return ParseBinOpRHS(0, std::move(LHS));
+    return ParseBinOpRHS(0, LHS);
 }
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    std::string FnName;
+/// prototype
+///   ::= 'pure'? (id | 'unary' op | 'binary' op number?)
+///       '(' (id typeannotation)* ')' (':' type)?
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
+    Symbol FnName;
 
     unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
     unsigned BinaryPrecedence = 30;
 
+    bool Pure = CurTok == tok_pure;
+    if (Pure)
+        getNextToken(); // eat 'pure'
+
     switch (CurTok) {
         case tok_identifier:
             Kind = 0;
-            FnName = IdentifierStr;
+            FnName = IdentifierSym;
+            if (FnName >= sym_vec2 && FnName <= sym_all) {
+                std::string Msg = std::string("'") + WellKnownNames[FnName] +
+                                  "' is a built-in function";
+                return LogErrorP(Msg.c_str());
+            }
             getNextToken();
             break;
         case tok_unary:
             getNextToken();
             if (!isascii(CurTok))
                 return LogErrorP("Expected unary operator"); 
-            FnName = "unary";
-            FnName += (char)CurTok;
+            FnName = Symbols.operatorSymbol(false, (char)CurTok);
             Kind = 1;
             getNextToken();
             break;
@@ -628,8 +1498,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
             getNextToken();
             if (!isascii(CurTok))
                 return LogErrorP("Expected binary operator");
-            FnName = "binary";
-            FnName += (char)CurTok;
+            FnName = Symbols.operatorSymbol(true, (char)CurTok);
             Kind = 2;
             getNextToken();
 
@@ -647,9 +1516,19 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier) {
-        ArgNames.push_back(IdentifierStr);
+    std::vector<Symbol> ArgNames;
+    std::vector<ValueType> ArgTypes;
+    llvm::SmallVector<std::pair<size_t, Symbol>, 4> LengthNames;
+    getNextToken(); // eat '('
+    while (CurTok == tok_identifier) {
+        ArgNames.push_back(IdentifierSym);
+        getNextToken(); // eat identifier
+        ArgTypes.emplace_back();
+        llvm::Optional<Symbol> Length;
+        if (!ParseTypeAnnotation(ArgTypes.back(), &Length))
+            return nullptr;
+        if (Length)
+            LengthNames.push_back({ArgNames.size() - 1, *Length});
     }
 
     if (CurTok != ')')
@@ -657,293 +1536,1329 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
 
     getNextToken(); // eat ')'
 
+    // The body may begin with a user defined unary ':', so a ':' is only the
+    // start of a return type if a type name follows it.
+    ValueType ReturnType = VT_Double;
+    if (CurTok == ':' && peekTypeName(ReturnType) &&
+        !ParseTypeAnnotation(ReturnType))
+        return nullptr;
+
     if (Kind && ArgNames.size() != Kind)
         return LogErrorP("Invalid number of operands for operator");
 
+    // An array's length is an int parameter, named before or after it.
+    std::vector<int> ArgLengths(ArgNames.size(), -1);
+    for (const auto& L : LengthNames) {
+        auto It = llvm::find(ArgNames, L.second);
+        if (It == ArgNames.end() || ArgTypes[It - ArgNames.begin()] != VT_Int)
+            return LogErrorP("array length must be an int parameter");
+        ArgLengths[L.first] = It - ArgNames.begin();
+    }
+
     return std::make_unique<PrototypeAST>(
         FnName,
         ArgNames,
         Kind != 0,
-        BinaryPrecedence
+        BinaryPrecedence,
+        Pure,
+        ArgTypes,
+        ReturnType,
+        ArgLengths
     );
 }
 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
     getNextToken();
+    Pool.clear();
 
     auto Proto = ParsePrototype();
     if (!Proto)
         return nullptr;
 
     auto E = ParseExpression();
-    if (!E)
+    if (E == NoExpr)
         return nullptr;
 
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    return finishFunction(std::move(Proto), E);
 }
 
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
+    Pool.clear();
     auto E = ParseExpression();
-    if (!E)
+    if (E == NoExpr)
         return nullptr;
 
-    auto Proto = std::make_unique<PrototypeAST>("__anonymous_expr",
-                                                std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    auto Proto = std::make_unique<PrototypeAST>(sym_anonymous_expr,
+                                                std::vector<Symbol>());
+    return finishFunction(std::move(Proto), E);
 }
 
 /// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
     getNextToken();
     return ParsePrototype();
 }
 
+//===----------------------------------------------------------------------===//
+// Expression simplification
+//===----------------------------------------------------------------------===//
+
+/// SimplifyExprs - Fold arithmetic and comparisons on constants, and replace
+/// an if whose condition is constant by the branch it takes.  Everything is
+/// done in place: the pool holds children before their parents, so one pass
+/// in index order finds each node's operands already simplified, and a node
+/// is simplified by overwriting it with a number or with the operand it
+/// reduces to.  Nodes left unreferenced are never visited by codegen.
+///
+/// Only rewrites that give the same double for every input are made, and the
+/// folds compute exactly what the generated fadd, fsub, fmul and "fcmp ult"
+/// would.  The pool has no types, so x * 1, 1 * x and x - 0, which would
+/// turn a bool x into an int, are left to visitBinary.
+static void SimplifyExprs(ExprPool& Pool) {
+    auto IsNumber = [&](ExprIdx E, double& Val) {
+        if (Pool[E].Kind != EK_Number)
+            return false;
+        Val = Pool.getNumber(Pool[E]);
+        return true;
+    };
+
+    for (ExprIdx E = 0, End = Pool.size(); E != End; ++E) {
+        ExprNode N = Pool[E];
+        double L, R;
+        if (N.Kind == EK_If && IsNumber(N.A, L)) {
+            // Codegen tests the condition with "fcmp one" against 0.
+            Pool.replaceWith(E, L != 0 && !std::isnan(L) ? N.B : N.C);
+            continue;
+        }
+        if (N.Kind != EK_Binary || N.Op == '=')
+            continue;
+
+        if (IsNumber(N.A, L) && IsNumber(N.B, R)) {
+            switch (N.Op) {
+                case '+': Pool.setNumber(E, L + R); break;
+                case '-': Pool.setNumber(E, L - R); break;
+                case '*': Pool.setNumber(E, L * R); break;
+                case '<': Pool.setNumber(E, !(L >= R)); break;
+            }
+        }
+    }
+}
+
 //===----------------------------------------------------------------------===//
 // Code Generation
 //===----------------------------------------------------------------------===//
 
-static llvm::LLVMContext TheContext; // 保存类型表和常量值表
-static llvm::IRBuilder<> Builder(TheContext); // 用于生成LLVM指令
-static std::unique_ptr<llvm::Module> TheModule; // 用于保存IR
-static std::map<std::string, llvm::AllocaInst*> NamedValues;
-static std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-static std::map<std::string, std::unique_ptr<PrototypeAST> > FunctionProtos;
+namespace {
+
+/// FunctionEffects - What a call to a function may do, as far as codegen
+/// knows.  SetEffectAttrs turns NoReads and NoWrites into readnone, readonly
+/// or writeonly, and each other flag that is set into the LLVM attribute of
+/// that name.
+struct FunctionEffects {
+    bool NoReads = false;     // Reads no memory the caller can see.
+    bool NoWrites = false;    // Writes no memory the caller can see.
+    bool ArgMemOnly = false;  // Touches only what its array arguments point to.
+    bool NoUnwind = false;    // Does not unwind.
+    bool NoRecurse = false;   // Never reaches a call to itself.
+    bool CallsUnknown = true; // May reach code that was not compiled first.
+
+    /// setReadNone - Touch no memory at all, which is argmemonly too.
+    void setReadNone() { NoReads = NoWrites = ArgMemOnly = true; }
+
+    /// meet - Keep only what holds for both these effects and Other.
+    void meet(const FunctionEffects& Other) {
+        NoReads &= Other.NoReads;
+        NoWrites &= Other.NoWrites;
+        ArgMemOnly &= Other.ArgMemOnly;
+        NoUnwind &= Other.NoUnwind;
+        CallsUnknown |= Other.CallsUnknown;
+    }
+};
+
+/// OperatorBody - A copy of a user defined operator's body, kept so uses of
+/// the operator can be generated in place instead of as calls.  Inlining is
+/// set while the body is being generated, so an operator that uses itself
+/// calls itself there rather than expanding forever.
+struct OperatorBody {
+    ExprPool Pool;
+    ExprIdx Body;
+    std::vector<Symbol> Args;
+    std::vector<ValueType> ArgTypes;
+    std::vector<int> ArgLengths;
+    ValueType ReturnType;
+    bool Inlining = false;
+};
+
+/// ScopedValues - The value each variable in scope is bound to: an alloca if
+/// the variable is assigned to, else the SSA value it holds.  They are kept
+/// in a flat vector indexed by Symbol, so a lookup is one load.  bind saves
+/// the binding it shadows on a stack, and leaveScope pops back to the depth
+/// enterScope returned, restoring them; a var or for scope costs a push per
+/// name and a pop per name, however deeply scopes nest.
+class ScopedValues {
+public:
+    /// lookup - The value Name is bound to, or null if it is not in scope.
+    llvm::Value* lookup(Symbol Name) const {
+        return Name < Values.size() ? Values[Name] : nullptr;
+    }
+
+    /// enterScope - Start a scope; pass the result to leaveScope to end it.
+    size_t enterScope() const { return Shadowed.size(); }
+
+    /// bind - Bind Name to V until the current scope ends.
+    void bind(Symbol Name, llvm::Value* V) {
+        if (Name >= Values.size())
+            Values.resize(std::max<size_t>(Name + 1, 2 * Values.size()));
+        Shadowed.push_back({Name, Values[Name]});
+        Values[Name] = V;
+    }
+
+    /// leaveScope - Undo every bind since enterScope returned Scope.
+    void leaveScope(size_t Scope) {
+        while (Shadowed.size() > Scope) {
+            Values[Shadowed.back().first] = Shadowed.back().second;
+            Shadowed.pop_back();
+        }
+    }
+
+    /// clear - Unbind everything, as when a new function starts.  Code that
+    /// stopped at an error may not have left its scopes.
+    void clear() { leaveScope(0); }
+
+private:
+    std::vector<llvm::Value*> Values;
+    std::vector<std::pair<Symbol, llvm::Value*> > Shadowed;
+};
+
+/// VectorBuiltin - The functions on vectors that need no declaration:
+/// select(mask, a, b), which picks lane by lane, and the horizontal
+/// reductions hsum, hmin, hmax, any and all.  Their names, like those of the
+/// vector constructors, are reserved: ParsePrototype rejects a function of
+/// that name, so a call means the same whenever it is compiled.
+enum VectorBuiltin : uint8_t {
+  VB_None, VB_Select, VB_HSum, VB_HMin, VB_HMax, VB_Any, VB_All,
+};
+
+/// BuiltinOf - The VectorBuiltin a call to Name makes, or VB_None.
+static VectorBuiltin BuiltinOf(Symbol Name) {
+    switch (Name) {
+        case sym_select: return VB_Select;
+        case sym_hsum:   return VB_HSum;
+        case sym_hmin:   return VB_HMin;
+        case sym_hmax:   return VB_HMax;
+        case sym_any:    return VB_Any;
+        case sym_all:    return VB_All;
+        default:         return VB_None;
+    }
+}
+
+/// CodeGen - The state of IR generation: the LLVM context, the builder and the
+/// module being filled in, and the tables that map Symbols to LLVM values.
+/// Each CompilerInstance has its own, with its own LLVMContext, so instances
+/// on different threads never share LLVM state.
+class CodeGen {
+public:
+    CodeGen(SymbolTable& Symbols, PrecedenceTable& BinopPrecedence)
+        : Builder(TheContext), Symbols(Symbols),
+          BinopPrecedence(BinopPrecedence) { }
+
+    PrototypeAST& SetFunctionProto(std::unique_ptr<PrototypeAST> P);
+    llvm::Function* getFunction(Symbol Name);
+    FunctionEffects getEffects(Symbol Name) const;
+    llvm::Type* getType(ValueType Ty);
+    llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* TheFunction,
+                                             Symbol VarName, llvm::Type* Ty);
+    llvm::Value* CreateConversion(llvm::Value* V, llvm::Type* To);
+
+    llvm::LLVMContext TheContext; // 保存类型表和常量值表
+    llvm::IRBuilder<> Builder; // 用于生成LLVM指令
+    std::unique_ptr<llvm::Module> TheModule; // 用于保存IR
+    ScopedValues NamedValues;
+    std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
+    /// FunctionProtos - The latest prototype seen for each function, indexed
+    /// by Symbol; null where the symbol does not name a function.
+    std::vector<std::unique_ptr<PrototypeAST> > FunctionProtos;
+    /// ModuleFunctions - The llvm::Function each Symbol names in TheModule, so
+    /// codegen does not look functions up by name.  Reset with the module.
+    llvm::DenseMap<Symbol, llvm::Function*> ModuleFunctions;
+    SymbolTable& Symbols;
+    PrecedenceTable& BinopPrecedence;
+    /// Effects - What each defined function may do, worked out from its body
+    /// when it is compiled, and given to every declaration of it after that.
+    llvm::DenseMap<Symbol, FunctionEffects> Effects;
+    /// OperatorBodies - The latest definition of each user operator.
+    llvm::DenseMap<Symbol, OperatorBody> OperatorBodies;
+    /// SimplifyAST - Run SimplifyExprs over each function body first.
+    bool SimplifyAST = true;
+    /// InlineOperators - Expand user operators where they are used.
+    bool InlineOperators = true;
+    /// SelfTailCalls - Turn self calls in tail position into loops.
+    bool SelfTailCalls = true;
+    /// MemoizePure - Cache the results of pure functions that call themselves.
+    bool MemoizePure = true;
+    /// IntegerLoops - Count loops with integral bounds in i64.
+    bool IntegerLoops = true;
+    /// ElideBoundsChecks - Check the range of a counted loop once instead of
+    /// each array index by its variable.
+    bool ElideBoundsChecks = true;
+    /// LoopPasses - Add the loop optimizations to TheFPM.
+    bool LoopPasses = true;
+    /// FastMath - The fast-math flags every floating point operation gets;
+    /// none by default, for strict IEEE arithmetic.
+    llvm::FastMathFlags FastMath;
+};
+
+} // end anonymous namespace
 
 llvm::Value* LogErrorV(const char* str) {
     LogError(str);
     return nullptr;
 }
 
-llvm::Function* getFunction(std::string Name) {
+/// SetFunctionProto - Record P as the prototype for its function.
+PrototypeAST& CodeGen::SetFunctionProto(std::unique_ptr<PrototypeAST> P) {
+    Symbol Name = P->getName();
+    if (Name >= FunctionProtos.size())
+        FunctionProtos.resize(Symbols.size());
+    FunctionProtos[Name] = std::move(P);
+    return *FunctionProtos[Name];
+}
+
+llvm::Function* CodeGen::getFunction(Symbol Name) {
     // First, see if the function has already been added to the current module.
-    if (auto* F = TheModule->getFunction(Name))
-        return F;
+    auto MI = ModuleFunctions.find(Name);
+    if (MI != ModuleFunctions.end())
+        return MI->second;
 
     // If not, check whether we can codegen the declaration from some existing
     // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+    if (Name < FunctionProtos.size() && FunctionProtos[Name])
+        return FunctionProtos[Name]->codegen(*this);
 
     // If no existing prototype exists, return null.
     return nullptr;
 }
 
+/// getEffects - What a call to Name may do.  Only pure externs are known not
+/// to touch memory or unwind; any other extern might do anything, even call
+/// back into the caller.
+FunctionEffects CodeGen::getEffects(Symbol Name) const {
+    auto It = Effects.find(Name);
+    if (It != Effects.end())
+        return It->second;
+
+    FunctionEffects FX;
+    if (Name < FunctionProtos.size() && FunctionProtos[Name] &&
+        FunctionProtos[Name]->isPure()) {
+        FX.setReadNone();
+        FX.NoUnwind = true;
+    }
+    return FX;
+}
+
+/// getType - The LLVM type values of type Ty have.
+llvm::Type* CodeGen::getType(ValueType Ty) {
+    switch (Ty) {
+        case VT_Double: return llvm::Type::getDoubleTy(TheContext);
+        case VT_Float:  return llvm::Type::getFloatTy(TheContext);
+        case VT_Int:    return llvm::Type::getInt64Ty(TheContext);
+        case VT_Bool:   return llvm::Type::getInt1Ty(TheContext);
+        case VT_Vec2:   return llvm::FixedVectorType::get(getType(VT_Double), 2);
+        case VT_Vec4:   return llvm::FixedVectorType::get(getType(VT_Double), 4);
+        case VT_Vec8:   return llvm::FixedVectorType::get(getType(VT_Double), 8);
+        default:
+            return getType(ValueType(Ty - VT_DoubleArray))->getPointerTo();
+    }
+}
+
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
-static llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* TheFunction,
-                                                const std::string& VarName) {
+llvm::AllocaInst* CodeGen::CreateEntryBlockAlloca(llvm::Function* TheFunction,
+                                                  Symbol VarName, llvm::Type* Ty) {
     llvm::IRBuilder<> TmpBuilder(&TheFunction->getEntryBlock(),
                                  TheFunction->getEntryBlock().begin());
-    return TmpBuilder.CreateAlloca(llvm::Type::getDoubleTy(TheContext), nullptr, VarName);
+    return TmpBuilder.CreateAlloca(Ty, nullptr, Symbols.name(VarName));
+}
+
+/// CreateConversion - Convert V to the type To, as C converts a value it
+/// assigns, passes or returns: numbers convert to numbers, a double or float
+/// to int rounding toward zero, and anything to bool by comparing it with
+/// zero, which a NaN is not equal to.  A bool converts to 0 or 1.  An array
+/// converts to nothing but itself; that is an error, and gives null.
+///
+/// A number converts to a vector by converting it to each lane.  Vectors
+/// convert lane by lane, between doubles and the masks of bools that
+/// comparing them gives, and only to vectors of as many lanes.
+llvm::Value* CodeGen::CreateConversion(llvm::Value* V, llvm::Type* To) {
+    llvm::Type* From = V->getType();
+    if (From == To)
+        return V;
+    if (From->isPointerTy() || To->isPointerTy())
+        return LogErrorV(From->isPointerTy() && To->isPointerTy()
+                             ? "arrays of different types do not mix"
+                             : "an array is not a number");
+    if (auto* ToVec = llvm::dyn_cast<llvm::FixedVectorType>(To)) {
+        auto* FromVec = llvm::dyn_cast<llvm::FixedVectorType>(From);
+        if (!FromVec) {
+            V = CreateConversion(V, ToVec->getElementType());
+            return V ? Builder.CreateVectorSplat(ToVec->getNumElements(), V, "splat")
+                     : nullptr;
+        }
+        if (FromVec->getNumElements() != ToVec->getNumElements())
+            return LogErrorV("vectors of different widths do not mix");
+        if (To->isIntOrIntVectorTy(1))
+            return Builder.CreateFCmpONE(V, llvm::ConstantFP::get(From, 0.0), "tomask");
+        return Builder.CreateUIToFP(V, To, "tofp");
+    }
+    if (From->isVectorTy())
+        return LogErrorV("a vector is not a number; reduce it with hsum, hmin, "
+                         "hmax, any or all");
+    if (To->isIntegerTy(1)) {
+        if (From->isFloatingPointTy())
+            return Builder.CreateFCmpONE(V, llvm::ConstantFP::get(From, 0.0), "tobool");
+        return Builder.CreateICmpNE(V, llvm::ConstantInt::get(From, 0), "tobool");
+    }
+    if (To->isIntegerTy()) {
+        if (From->isFloatingPointTy())
+            return Builder.CreateFPToSI(V, To, "toint");
+        return Builder.CreateZExt(V, To, "toint");
+    }
+    if (From->isFloatingPointTy())
+        return Builder.CreateFPCast(V, To, "tofp");
+    if (From->isIntegerTy(1))
+        return Builder.CreateUIToFP(V, To, "tofp");
+    return Builder.CreateSIToFP(V, To, "tofp");
+}
+
+/// TypeRank - Where Ty stands in bool < int < float < double < mask < vector;
+/// operands of a built-in operator or the branches of an if are converted to
+/// the higher.
+static unsigned TypeRank(llvm::Type* Ty) {
+    if (Ty->isVectorTy())
+        return Ty->isFPOrFPVectorTy() ? 5 : 4;
+    if (Ty->isDoubleTy())
+        return 3;
+    if (Ty->isFloatTy())
+        return 2;
+    return Ty->isIntegerTy(1) ? 0 : 1;
+}
+
+/// ElementAccessTag - The TBAA tag of a load or store of an array element of
+/// type Ty.  Each element type is a scalar type of its own under one root,
+/// so LLVM knows that a store to a float array leaves int arrays as they are.
+static llvm::MDNode* ElementAccessTag(llvm::LLVMContext& Context, llvm::Type* Ty) {
+    llvm::MDBuilder MDB(Context);
+    const char* Name = Ty->isDoubleTy() ? "double"
+                       : Ty->isFloatTy() ? "float"
+                       : Ty->isIntegerTy(1) ? "bool" : "int";
+    llvm::MDNode* Scalar = MDB.createTBAAScalarTypeNode(
+        Name, MDB.createTBAARoot("Kaleidoscope TBAA"));
+    return MDB.createTBAAStructTagNode(Scalar, Scalar, 0);
+}
+
+/// SimdLoopID - The llvm.loop metadata of a for simd loop with hints H:
+/// vectorize it whatever the cost model thinks, at the width and with the
+/// interleave count asked for, and take the memory accesses in AccessGroup
+/// not to depend on each other from one iteration to the next.  The
+/// vectorizer may then also reorder the loop's floating point reductions,
+/// as it would with fast-math.
+static llvm::MDNode* SimdLoopID(llvm::LLVMContext& Context, LoopHints H,
+                                llvm::MDNode* AccessGroup) {
+    auto Hint = [&](const char* Name, llvm::Metadata* Value) {
+        return llvm::MDNode::get(Context, {llvm::MDString::get(Context, Name), Value});
+    };
+    auto Int = [&](llvm::Type* Ty, unsigned N) {
+        return llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(Ty, N));
+    };
+    llvm::Type* Int1Ty = llvm::Type::getInt1Ty(Context);
+    llvm::Type* Int32Ty = llvm::Type::getInt32Ty(Context);
+
+    // The first operand is the loop ID itself, filled in below.
+    llvm::SmallVector<llvm::Metadata*, 5> Ops = {nullptr};
+    Ops.push_back(Hint("llvm.loop.vectorize.enable", Int(Int1Ty, 1)));
+    if (H.Width)
+        Ops.push_back(Hint("llvm.loop.vectorize.width", Int(Int32Ty, H.Width)));
+    if (H.Unroll)
+        Ops.push_back(Hint("llvm.loop.interleave.count", Int(Int32Ty, H.Unroll)));
+    Ops.push_back(Hint("llvm.loop.parallel_accesses", AccessGroup));
+    llvm::MDNode* ID = llvm::MDNode::getDistinct(Context, Ops);
+    ID->replaceOperandWith(0, ID);
+    return ID;
+}
+
+/// CopyLoopID - A loop ID with the same hints as ID, for a copy of its loop;
+/// no two loops may share one.
+static llvm::MDNode* CopyLoopID(llvm::MDNode* ID) {
+    llvm::SmallVector<llvm::Metadata*, 5> Ops = {nullptr};
+    Ops.append(ID->op_begin() + 1, ID->op_end());
+    llvm::MDNode* Copy = llvm::MDNode::getDistinct(ID->getContext(), Ops);
+    Copy->replaceOperandWith(0, Copy);
+    return Copy;
+}
+
+namespace {
+
+/// CountedLoop - A for loop that provably counts through whole numbers: its
+/// variable is never assigned, it starts at the integer Start, steps by the
+/// positive integer Step, and runs while the variable is less than Bound, an
+/// expression whose value cannot change inside the loop.
+struct CountedLoop {
+    int64_t Start, Step;
+    ExprIdx Bound;
+};
+
+/// CounterScope - A counted loop being generated, as its body sees it: Var
+/// is what the loop variable is bound to, and Counter the i64 that counts.
+/// Where Unchecked is set, indexing an array whose length is known by the
+/// loop variable skips the bounds check, and the element address and the
+/// length go in Elided, for the loop's guard to check the whole range
+/// against instead.
+struct CounterScope {
+    llvm::Value* Var;
+    llvm::Value* Counter;
+    bool Unchecked;
+    llvm::SmallVector<std::pair<llvm::GetElementPtrInst*, llvm::Value*>, 4> Elided;
+    /// HoldsVersionedLoop - Whether a loop in the body was versioned.
+    bool HoldsVersionedLoop;
+};
+
+/// TailCallLoop - Where a self call in tail position goes instead of calling:
+/// it passes its arguments to the function's parameters, each a phi in Header
+/// or an alloca if the body assigns to it, and branches to Header, the block
+/// after the parameters are set up.
+struct TailCallLoop {
+    Symbol Self;
+    llvm::BasicBlock* Header = nullptr;
+    std::vector<llvm::Value*> Params;
+};
+
+/// ExprCodeGen - Emits the IR for the expressions of one function body.
+class ExprCodeGen : public ExprVisitor<ExprCodeGen, llvm::Value*> {
+public:
+    ExprCodeGen(CodeGen& CG, const ExprPool& Pool,
+                const TailCallLoop* Loop = nullptr)
+        : ExprVisitor<ExprCodeGen, llvm::Value*>(Pool), CG(CG), Loop(Loop) {
+        for (ExprIdx E = 0, End = Pool.size(); E != End; ++E)
+            if (Pool[E].Kind == EK_Binary && Pool[E].Op == '=' &&
+                Pool[Pool[E].A].Kind == EK_Variable)
+                Assigned.insert(Pool[Pool[E].A].A);
+    }
+
+    /// isAssigned - Whether the body assigns to some variable called Name.
+    /// Only those need an alloca; the others are bound to their values.
+    bool isAssigned(Symbol Name) const { return Assigned.count(Name); }
+
+    bool bindArrayLengths(llvm::ArrayRef<Symbol> Args,
+                          llvm::ArrayRef<int> Lengths,
+                          llvm::ArrayRef<llvm::Value*> Values);
+
+    /// visit - Generate E.  Tail says its value is returned as it is, through
+    /// nothing but ifs and var bodies, so a self call there may be a branch.
+    llvm::Value* visit(ExprIdx E, bool Tail = false) {
+        bool OuterTail = InTail;
+        InTail = Tail;
+        llvm::Value* V = ExprVisitor<ExprCodeGen, llvm::Value*>::visit(E);
+        InTail = OuterTail;
+        return V;
+    }
+
+    llvm::Value* visitLiteralAs(ExprIdx E, llvm::Type* Ty, bool Tail = false);
+
+    llvm::Value* visitNumber(ExprNode N);
+    llvm::Value* visitVariable(ExprNode N);
+    llvm::Value* visitUnary(ExprNode N);
+    llvm::Value* visitBinary(ExprNode N);
+    llvm::Value* visitCall(ExprNode N);
+    llvm::Value* visitIf(ExprNode N);
+    llvm::Value* visitFor(ExprNode N);
+    llvm::Value* visitVar(ExprNode N);
+    llvm::Value* visitIndex(ExprNode N);
+    llvm::Value* visitVector(ExprNode N);
+
+private:
+    llvm::Value* emitNumber(ExprNode N, llvm::Type* Ty);
+    llvm::Value* emitBuiltin(char Op, llvm::Value* L, llvm::Value* R);
+    llvm::Value* emitOperator(Symbol Name, llvm::ArrayRef<llvm::Value*> Operands,
+                              const char* CallName);
+    llvm::Value* emitVectorBuiltin(VectorBuiltin Kind, ExprNode N);
+    llvm::Value* emitLane(llvm::Value* Vector, ExprIdx Index);
+    llvm::Value* emitElementAddress(llvm::Value* Array, ExprNode N);
+    void addToAccessGroups(llvm::Instruction* Access);
+    void setLoopHints(llvm::BranchInst* Latch, ExprNode N);
+    llvm::Value* emitFor(ExprNode N);
+    void emitBoundsCheck(llvm::Value* Index, llvm::Value* Length);
+    void branchIfInBounds(llvm::Value* Index, llvm::Value* Length,
+                          llvm::BasicBlock* OkBB);
+    void insertBoundsCheck(llvm::GetElementPtrInst* Addr, llvm::Value* Length);
+    bool isLoopInvariant(ExprIdx E, Symbol VarName) const;
+    bool isCountedLoop(ExprNode N, CountedLoop& L) const;
+    llvm::Value* emitCountedLoop(ExprNode N, const CountedLoop& L);
+    llvm::BasicBlock* emitCounter(ExprNode N, const CountedLoop& L,
+                                  llvm::Value* Limit, llvm::BasicBlock* PreheaderBB,
+                                  llvm::BasicBlock* AfterBB, CounterScope& Scope);
+    llvm::BasicBlock* emitCheckedCopy(llvm::BasicBlock* LoopBB,
+                                      const CounterScope& Scope);
+
+    CodeGen& CG;
+    const TailCallLoop* Loop;
+    bool InTail = false;
+    /// IfLiteralTy - The type visitLiteralAs wants from the if it is about to
+    /// visit, for that if's literal branches.
+    llvm::Type* IfLiteralTy = nullptr;
+    llvm::SmallDenseSet<Symbol, 8> Assigned;
+    /// ArrayLengths - The length of each array value that has one.
+    llvm::SmallDenseMap<llvm::Value*, llvm::Value*, 4> ArrayLengths;
+    /// Counters - The counted loops around the code being generated, the
+    /// innermost last.
+    llvm::SmallVector<CounterScope*, 4> Counters;
+    /// TrapBB - Where a failed bounds check goes; made by the first check.
+    llvm::BasicBlock* TrapBB = nullptr;
+    /// AccessGroups - The access group of each for simd loop around the code
+    /// being generated, the innermost last.
+    llvm::SmallVector<llvm::MDNode*, 2> AccessGroups;
+};
+
+} // end anonymous namespace
+
+llvm::Value* ExprCodeGen::visitNumber(ExprNode N) {
+    double Val = Pool.getNumber(N);
+    return llvm::ConstantFP::get(CG.TheContext, llvm::APFloat(Val));
+}
+
+/// emitNumber - The number N as a constant of the type Ty that the code
+/// around it works in, so that a literal does not turn int or float code
+/// into double code: an int if N is a whole number (a bool counts as an
+/// int), or a float, rounded as "float x = N" would round it.  Otherwise N
+/// is a double, as always.
+llvm::Value* ExprCodeGen::emitNumber(ExprNode N, llvm::Type* Ty) {
+    double Val = Pool.getNumber(N);
+    if (Ty->isIntegerTy() && Val == std::trunc(Val) &&
+        std::fabs(Val) < 9223372036854775808.0)
+        return llvm::ConstantInt::get(llvm::Type::getInt64Ty(CG.TheContext),
+                                      (int64_t)Val, true);
+    if (Ty->isFloatTy() && std::isfinite((float)Val))
+        return llvm::ConstantFP::get(Ty, Val);
+    return visitNumber(N);
 }
 
-llvm::Value* NumberExprAST::codegen() {
-    return llvm::ConstantFP::get(TheContext, llvm::APFloat(Val));
+/// visitLiteralAs - Generate E where a value of type Ty is wanted.  If E is
+/// a number literal, or an if with literal branches, those numbers are
+/// emitted by emitNumber as Ty.
+llvm::Value* ExprCodeGen::visitLiteralAs(ExprIdx E, llvm::Type* Ty, bool Tail) {
+    if (Pool[E].Kind == EK_Number)
+        return emitNumber(Pool[E], Ty);
+    if (Pool[E].Kind == EK_If)
+        IfLiteralTy = Ty;
+    return visit(E, Tail);
 }
 
-llvm::Value* VariableExprAST::codegen() {
-    llvm::Value* V = NamedValues[Name];
+llvm::Value* ExprCodeGen::visitVariable(ExprNode N) {
+    Symbol Name = N.A;
+    llvm::Value* V = CG.NamedValues.lookup(Name);
     if (!V) {
         char buf[128];
-        sprintf(buf, "Unknown variable name: '%s'", Name.c_str());
-        LogErrorV(buf);
+        snprintf(buf, sizeof(buf), "Unknown variable name: '%s'",
+                 CG.Symbols.name(Name).str().c_str());
+        return LogErrorV(buf);
     }
-    return Builder.CreateLoad(V, Name.c_str());
+    if (llvm::isa<llvm::AllocaInst>(V))
+        return CG.Builder.CreateLoad(V, CG.Symbols.name(Name));
+    return V;
 }
 
-llvm::Value* UnaryExprAST::codegen() {
-    llvm::Value* OperandV = Operand->codegen();
-
-    llvm::Function* F = getFunction(std::string("unary") + Op);
-    assert (F && "unary operator not found!");
+llvm::Value* ExprCodeGen::visitUnary(ExprNode N) {
+    char Op = N.Op;
+    ExprIdx Operand = N.A;
+    llvm::Value* OperandV = visit(Operand);
+    if (!OperandV)
+        return nullptr;
 
-    return Builder.CreateCall(F, OperandV, "unop");
+    return emitOperator(CG.Symbols.operatorSymbol(false, Op), OperandV, "unop");
 }
 
-llvm::Value* BinaryExprAST::codegen() {
+llvm::Value* ExprCodeGen::visitBinary(ExprNode N) {
+    char Op = N.Op;
+    ExprIdx LHS = N.A, RHS = N.B;
+
     // Special case '=' because we don't want to emit the LHS as an expression.
-    if (Op == '=') {
-        VariableExprAST* LHSE = static_cast<VariableExprAST*>(LHS.get());
-        if (!LHSE)
-            return LogErrorV("destination of '=' must be a variable");
+    if (Op == '=' && Pool[LHS].Kind == EK_Index) {
+        llvm::Value* Array = visitVariable({EK_Variable, 0, Pool[LHS].A, 0, 0});
+        if (!Array)
+            return nullptr;
+        if (Array->getType()->isVectorTy())
+            return LogErrorV("the lanes of a vector cannot be assigned; build a "
+                             "new vector, or select into it");
+        llvm::Value* Addr = emitElementAddress(Array, Pool[LHS]);
+        if (!Addr)
+            return nullptr;
+        llvm::Type* ElemTy = Addr->getType()->getPointerElementType();
 
-        // Codegen the RHS.
-        llvm::Value* Val = RHS->codegen();
-        if (!Val)
+        llvm::Value* Val = visitLiteralAs(RHS, ElemTy);
+        if (!Val || !(Val = CG.CreateConversion(Val, ElemTy)))
             return nullptr;
+        llvm::StoreInst* Store = CG.Builder.CreateStore(Val, Addr);
+        Store->setMetadata(llvm::LLVMContext::MD_tbaa,
+                           ElementAccessTag(CG.TheContext, ElemTy));
+        addToAccessGroups(Store);
+        return Val;
+    }
+    if (Op == '=') {
+        if (Pool[LHS].Kind != EK_Variable)
+            return LogErrorV("destination of '=' must be a variable or an array element");
 
-        // Look up the name.
-        llvm::Value* Variable = NamedValues[LHSE->getName()];
+        // Look up the name.  Variables that are assigned to live in allocas.
+        llvm::Value* Variable = CG.NamedValues.lookup(Pool[LHS].A);
         if (!Variable)
             return LogErrorV("Unknown variable name");
+        llvm::Type* VarTy = llvm::cast<llvm::AllocaInst>(Variable)->getAllocatedType();
+
+        // Codegen the RHS.
+        llvm::Value* Val = visitLiteralAs(RHS, VarTy);
+        if (!Val || !(Val = CG.CreateConversion(Val, VarTy)))
+            return nullptr;
 
-        Builder.CreateStore(Val, Variable);
+        CG.Builder.CreateStore(Val, Variable);
         return Val;
     }
 
-    llvm::Value* L = LHS->codegen();
-    llvm::Value* R = RHS->codegen();
-    if (!L || !R)
-        return nullptr;
+    // A literal operand is emitted after the other one, so it can take that
+    // one's type; it has no code of its own, so the order does not show.
+    llvm::Value *L, *R;
+    if (Pool[LHS].Kind == EK_Number && Pool[RHS].Kind != EK_Number) {
+        R = visit(RHS);
+        if (!R)
+            return nullptr;
+        L = emitNumber(Pool[LHS], R->getType());
+    } else {
+        L = visit(LHS);
+        if (!L)
+            return nullptr;
+        R = visitLiteralAs(RHS, L->getType());
+        if (!R)
+            return nullptr;
+    }
 
-    switch (Op) {
-        case '+': return Builder.CreateFAdd(L, R, "addtmp");
-        case '-': return Builder.CreateFSub(L, R, "subtmp");
-        case '*': return Builder.CreateFMul(L, R, "multmp");
-        case '<': 
-            L = Builder.CreateFCmpULT(L, R, "cmptmp");
-            return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext), "booltmp");
-        default:
-            break;
+    // x * 1, 1 * x and x - 0 are x, where x already has the type the
+    // operator would work in: not a bool, which it would make an int, nor an
+    // array, which it rejects.  x + 0 stays, as it turns -0 into +0.
+    if (CG.SimplifyAST) {
+        auto IsNumber = [&](ExprIdx E, double Val) {
+            return Pool[E].Kind == EK_Number && Pool.getNumber(Pool[E]) == Val &&
+                   !std::signbit(Pool.getNumber(Pool[E]));
+        };
+        llvm::Value* X = nullptr;
+        if ((Op == '*' && IsNumber(RHS, 1)) || (Op == '-' && IsNumber(RHS, 0)))
+            X = L;
+        else if (Op == '*' && IsNumber(LHS, 1))
+            X = R;
+        if (X && !X->getType()->isPointerTy() && !X->getType()->isIntegerTy(1))
+            return X;
     }
 
-    llvm::Function* F = getFunction(std::string("binary") + Op);
-    assert (F && "binary operator not found!");
+    if (strchr("+-*<", Op))
+        return emitBuiltin(Op, L, R);
 
     llvm::Value* Ops[2] = {L, R};
-    return Builder.CreateCall(F, Ops, "binop");
+    return emitOperator(CG.Symbols.operatorSymbol(true, Op), Ops, "binop");
+}
+
+/// emitBuiltin - Apply the built-in operator Op to L and R, converting them
+/// to the higher ranked of their types first.  Arithmetic on bools is done
+/// on ints; '<' gives a bool.  Arrays are not operands.  If either operand
+/// is a vector the operator applies lane by lane to vectors of doubles, a
+/// number being broadcast to every lane, and '<' gives a mask.
+llvm::Value* ExprCodeGen::emitBuiltin(char Op, llvm::Value* L, llvm::Value* R) {
+    if (L->getType()->isPointerTy() || R->getType()->isPointerTy())
+        return LogErrorV("an array is not a number");
+    llvm::Type* Ty = TypeRank(L->getType()) >= TypeRank(R->getType())
+                         ? L->getType() : R->getType();
+    if (Ty->isVectorTy())
+        Ty = llvm::FixedVectorType::get(
+            llvm::Type::getDoubleTy(CG.TheContext),
+            llvm::cast<llvm::FixedVectorType>(Ty)->getNumElements());
+    else if (Op != '<' && Ty->isIntegerTy(1))
+        Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    L = CG.CreateConversion(L, Ty);
+    if (!L)
+        return nullptr;
+    R = CG.CreateConversion(R, Ty);
+    if (!R)
+        return nullptr;
+
+    if (Ty->isFPOrFPVectorTy()) {
+        switch (Op) {
+            case '+': return CG.Builder.CreateFAdd(L, R, "addtmp");
+            case '-': return CG.Builder.CreateFSub(L, R, "subtmp");
+            case '*': return CG.Builder.CreateFMul(L, R, "multmp");
+            case '<': return CG.Builder.CreateFCmpULT(L, R, "cmptmp");
+        }
+    } else {
+        switch (Op) {
+            case '+': return CG.Builder.CreateAdd(L, R, "addtmp");
+            case '-': return CG.Builder.CreateSub(L, R, "subtmp");
+            case '*': return CG.Builder.CreateMul(L, R, "multmp");
+            case '<':
+                if (Ty->isIntegerTy(1))
+                    return CG.Builder.CreateICmpULT(L, R, "cmptmp");
+                return CG.Builder.CreateICmpSLT(L, R, "cmptmp");
+        }
+    }
+    llvm_unreachable("not a built-in operator");
+}
+
+/// emitOperator - Apply a user defined operator to operands that have already
+/// been evaluated.  If its body is known it is generated right here, with its
+/// parameters bound to the operands, as if it had been written out in place;
+/// in the JIT each operator lives in its own module, so LLVM could never
+/// inline the call.  Otherwise call the operator function.
+llvm::Value* ExprCodeGen::emitOperator(Symbol Name,
+                                       llvm::ArrayRef<llvm::Value*> Operands,
+                                       const char* CallName) {
+    auto It = CG.InlineOperators ? CG.OperatorBodies.find(Name)
+                                 : CG.OperatorBodies.end();
+    if (It == CG.OperatorBodies.end() || It->second.Inlining) {
+        llvm::Function* F = CG.getFunction(Name);
+        assert (F && "operator not found!");
+        llvm::SmallVector<llvm::Value*, 2> Args;
+        for (size_t i = 0; i != Operands.size(); ++i) {
+            llvm::Value* Arg = CG.CreateConversion(
+                Operands[i], F->getFunctionType()->getParamType(i));
+            if (!Arg)
+                return nullptr;
+            Args.push_back(Arg);
+        }
+        return CG.Builder.CreateCall(F, Args, CallName);
+    }
+
+    // The body compiled on its own, so every name in it is a parameter or
+    // bound inside it; the caller's variables stay in scope but are shadowed
+    // or never named.
+    OperatorBody& Op = It->second;
+    ExprCodeGen BodyGen(CG, Op.Pool);
+    BodyGen.AccessGroups = AccessGroups;
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
+    size_t Scope = CG.NamedValues.enterScope();
+    llvm::SmallVector<llvm::Value*, 2> Bound;
+    for (size_t i = 0; i != Operands.size(); ++i) {
+        llvm::Type* ArgTy = CG.getType(Op.ArgTypes[i]);
+        llvm::Value* Operand = CG.CreateConversion(Operands[i], ArgTy);
+        if (!Operand)
+            return nullptr;
+        Bound.push_back(Operand);
+        if (!BodyGen.isAssigned(Op.Args[i])) {
+            CG.NamedValues.bind(Op.Args[i], Operand);
+            continue;
+        }
+        llvm::AllocaInst* Alloca =
+            CG.CreateEntryBlockAlloca(TheFunction, Op.Args[i], ArgTy);
+        CG.Builder.CreateStore(Operand, Alloca);
+        CG.NamedValues.bind(Op.Args[i], Alloca);
+    }
+    if (!BodyGen.bindArrayLengths(Op.Args, Op.ArgLengths, Bound))
+        return nullptr;
+
+    Op.Inlining = true;
+    llvm::Value* V = BodyGen.visit(Op.Body);
+    Op.Inlining = false;
+    CG.NamedValues.leaveScope(Scope);
+    if (!V)
+        return nullptr;
+    return CG.CreateConversion(V, CG.getType(Op.ReturnType));
 }
 
-llvm::Value* CallExprAST::codegen() {
+llvm::Value* ExprCodeGen::visitCall(ExprNode N) {
+    Symbol Callee = N.A;
+    llvm::ArrayRef<uint32_t> Args = Pool.getExtra(N.B, N.C);
+
     // Look up the name in the global module table.
-    llvm::Function* CalleeF = getFunction(Callee);
+    llvm::Function* CalleeF = CG.getFunction(Callee);
     if (!CalleeF) {
+        if (VectorBuiltin Kind = BuiltinOf(Callee))
+            return emitVectorBuiltin(Kind, N);
         char buf[128];
-        sprintf(buf, "Unknown function referenced: '%s'", Callee.c_str());
+        snprintf(buf, sizeof(buf), "Unknown function referenced: '%s'",
+                 CG.Symbols.name(Callee).str().c_str());
         return LogErrorV(buf);
     }
 
     if (CalleeF->arg_size() != Args.size()) {
         char buf[128];
-        sprintf(buf, "Incorrect # arguments passed when call function: '%s'", Callee.c_str());
+        snprintf(buf, sizeof(buf), "Incorrect # arguments passed when call function: '%s'",
+                 CG.Symbols.name(Callee).str().c_str());
         return LogErrorV(buf);
     }
 
     std::vector<llvm::Value*> ArgsV;
     for (unsigned i = 0, e = Args.size(); i < e; ++i) {
-        ArgsV.push_back(Args[i]->codegen());
-        if (!ArgsV.back())
+        llvm::Type* ParamTy = CalleeF->getFunctionType()->getParamType(i);
+        llvm::Value* ArgV = visitLiteralAs(Args[i], ParamTy);
+        if (!ArgV || !(ArgV = CG.CreateConversion(ArgV, ParamTy)))
             return nullptr;
+        ArgsV.push_back(ArgV);
     }
-    return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+
+    if (InTail && Loop && Loop->Header && Callee == Loop->Self) {
+        // All the arguments are evaluated before any parameter changes.
+        llvm::BasicBlock* CallBB = CG.Builder.GetInsertBlock();
+        for (unsigned i = 0, e = ArgsV.size(); i < e; ++i) {
+            if (auto* PN = llvm::dyn_cast<llvm::PHINode>(Loop->Params[i]))
+                PN->addIncoming(ArgsV[i], CallBB);
+            else
+                CG.Builder.CreateStore(ArgsV[i], Loop->Params[i]);
+        }
+        CG.Builder.CreateBr(Loop->Header);
+
+        // The enclosing ifs still want a block to branch out of and a value
+        // to merge; give them an unreachable block and undef.
+        llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
+        CG.Builder.SetInsertPoint(
+            llvm::BasicBlock::Create(CG.TheContext, "aftertail", TheFunction));
+        return llvm::UndefValue::get(TheFunction->getReturnType());
+    }
+    return CG.Builder.CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
-llvm::Value* IfExprAST::codegen() {
-    llvm::Value* CondV = Cond->codegen();
+llvm::Value* ExprCodeGen::visitIf(ExprNode N) {
+    ExprIdx Cond = N.A, Then = N.B, Else = N.C;
+    llvm::Type* LiteralTy =
+        IfLiteralTy ? IfLiteralTy : llvm::Type::getDoubleTy(CG.TheContext);
+    IfLiteralTy = nullptr;
+    llvm::Value* CondV = visit(Cond);
     if (!CondV) {
         return nullptr;
     }
 
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    CondV = Builder.CreateFCmpONE( //Ordered and Not Equal
-        CondV,
-        llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "ifcond");
+    // A comparison is a bool already; a number is true if it is not 0.
+    CondV = CG.CreateConversion(CondV, llvm::Type::getInt1Ty(CG.TheContext));
+    if (!CondV)
+        return nullptr;
 
-    llvm::Function* TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
 
     // Create blocks for the then and else cases.  
     // Insert the 'then' block at the end of the function.
-    llvm::BasicBlock* ThenBB  = llvm::BasicBlock::Create(TheContext, "then", TheFunction);
-    llvm::BasicBlock* ElseBB  = llvm::BasicBlock::Create(TheContext, "else");
-    llvm::BasicBlock* MergeBB = llvm::BasicBlock::Create(TheContext, "ifcont");
-
-    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
-
-    // Emit then block.
-    Builder.SetInsertPoint(ThenBB);
-    llvm::Value* ThenV = Then->codegen();
-    if (!ThenV)
-        return nullptr;
-
-    Builder.CreateBr(MergeBB);
-    ThenBB = Builder.GetInsertBlock();
+    llvm::BasicBlock* ThenBB  = llvm::BasicBlock::Create(CG.TheContext, "then", TheFunction);
+    llvm::BasicBlock* ElseBB  = llvm::BasicBlock::Create(CG.TheContext, "else");
+    llvm::BasicBlock* MergeBB = llvm::BasicBlock::Create(CG.TheContext, "ifcont");
+
+    CG.Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+
+    // Emit then block.  A literal branch waits for the other branch's type.
+    CG.Builder.SetInsertPoint(ThenBB);
+    llvm::Value* ThenV = nullptr;
+    if (Pool[Then].Kind != EK_Number) {
+        ThenV = visitLiteralAs(Then, LiteralTy, InTail);
+        if (!ThenV)
+            return nullptr;
+    }
+    ThenBB = CG.Builder.GetInsertBlock();
 
     // Emit else block.
     TheFunction->getBasicBlockList().push_back(ElseBB);
-    Builder.SetInsertPoint(ElseBB);
-    llvm::Value* ElseV = Else->codegen();
+    CG.Builder.SetInsertPoint(ElseBB);
+    llvm::Value* ElseV =
+        visitLiteralAs(Else, ThenV ? ThenV->getType() : LiteralTy, InTail);
     if (!ElseV)
         return nullptr;
-
-    Builder.CreateBr(MergeBB);
-    ElseBB = Builder.GetInsertBlock();
+    if (!ThenV)
+        ThenV = emitNumber(Pool[Then], ElseV->getType());
+    ElseBB = CG.Builder.GetInsertBlock();
+
+    // Both branches convert to the higher ranked of their types.
+    llvm::Type* Ty = TypeRank(ThenV->getType()) >= TypeRank(ElseV->getType())
+                         ? ThenV->getType() : ElseV->getType();
+    CG.Builder.SetInsertPoint(ThenBB);
+    ThenV = CG.CreateConversion(ThenV, Ty);
+    if (!ThenV)
+        return nullptr;
+    CG.Builder.CreateBr(MergeBB);
+    CG.Builder.SetInsertPoint(ElseBB);
+    ElseV = CG.CreateConversion(ElseV, Ty);
+    if (!ElseV)
+        return nullptr;
+    CG.Builder.CreateBr(MergeBB);
 
     // Emit merge block.
     TheFunction->getBasicBlockList().push_back(MergeBB);
-    Builder.SetInsertPoint(MergeBB);
-    llvm::PHINode* PN = Builder.CreatePHI(llvm::Type::getDoubleTy(TheContext), 2, "iftmp");
+    CG.Builder.SetInsertPoint(MergeBB);
+    llvm::PHINode* PN = CG.Builder.CreatePHI(Ty, 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
     return PN;
 }
 
-llvm::Value* ForExprAST::codegen() {
-    llvm::Function* TheFunction = Builder.GetInsertBlock()->getParent();
-    llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    
-    llvm::Value* StartV = Start->codegen();
-    if (!StartV)
+/// isLoopInvariant - Whether E, the bound of a for loop over VarName, has the
+/// same value on every iteration: it is made of numbers and of variables,
+/// other than the loop's, that are never assigned, with the built-in +, -
+/// and *.  Those variables are bound outside the loop, so they hold the same
+/// value throughout it.
+bool ExprCodeGen::isLoopInvariant(ExprIdx E, Symbol VarName) const {
+    const ExprNode& N = Pool[E];
+    switch (N.Kind) {
+        case EK_Number:
+            return true;
+        case EK_Variable:
+            return N.A != VarName && !isAssigned(N.A);
+        case EK_Binary:
+            return (N.Op == '+' || N.Op == '-' || N.Op == '*') &&
+                   isLoopInvariant(N.A, VarName) && isLoopInvariant(N.B, VarName);
+        default:
+            return false;
+    }
+}
+
+/// isCountedLoop - Whether the for loop N is a CountedLoop, filling in L if
+/// so.
+bool ExprCodeGen::isCountedLoop(ExprNode N, CountedLoop& L) const {
+    Symbol VarName = N.A;
+    llvm::ArrayRef<uint32_t> Parts = Pool.getExtra(N.B, 4);
+    ExprIdx Start = Parts[0], End = Parts[1], Step = Parts[2];
+    // Whole numbers a double holds exactly, so counting in i64 and converting
+    // gives the same values as counting in double.
+    auto GetInteger = [&](ExprIdx E, int64_t& I) {
+        if (Pool[E].Kind != EK_Number)
+            return false;
+        double D = Pool.getNumber(Pool[E]);
+        if (D != std::trunc(D) || std::fabs(D) > 9007199254740992.0)
+            return false;
+        I = (int64_t)D;
+        return true;
+    };
+
+    // A float counter would round where the i64 one does not.
+    if (N.Op == VT_Float || N.Op == VT_Bool)
+        return false;
+    if (isAssigned(VarName) || !GetInteger(Start, L.Start))
+        return false;
+    L.Step = 1;
+    if (Step != NoExpr && (!GetInteger(Step, L.Step) || L.Step <= 0))
+        return false;
+
+    const ExprNode& Cond = Pool[End];
+    if (Cond.Kind != EK_Binary || Cond.Op != '<' ||
+        Pool[Cond.A].Kind != EK_Variable || Pool[Cond.A].A != VarName)
+        return false;
+    L.Bound = Cond.B;
+    return isLoopInvariant(L.Bound, VarName);
+}
+
+/// emitCountedLoop - Emit the for loop N with an i64 induction variable, so
+/// that LLVM's loop passes can compute its trip count.  The loop variable
+/// the body sees is the counter itself if it is an int, else the counter
+/// converted to double.  As in any for loop the body runs once before the
+/// condition is tested.  The bound is evaluated once, up front.  An int
+/// bound is compared as it is; otherwise "i < Bound" becomes
+/// "i < ceil(Bound)" in integers, and a NaN bound never stops the loop, as
+/// before.
+///
+/// Array indexes by the loop variable use the counter.  The body is
+/// generated once, without checking those.  If that left out any checks, the
+/// loop's blocks are copied and the checks put back in the copy, which runs
+/// unless a guard finds every value the counter takes within each array's
+/// length.  Only the innermost loops are versioned so: copying one that held
+/// a versioned loop would copy that loop's two versions again, so such a
+/// loop has its own checks put back in place instead.
+llvm::Value* ExprCodeGen::emitCountedLoop(ExprNode N, const CountedLoop& L) {
+    llvm::Type* DoubleTy = llvm::Type::getDoubleTy(CG.TheContext);
+    llvm::Type* Int64Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
+
+    llvm::Value* BoundV = visit(L.Bound);
+    if (!BoundV)
+        return nullptr;
+    llvm::Value* Limit;
+    if (BoundV->getType()->isIntegerTy()) {
+        Limit = CG.CreateConversion(BoundV, Int64Ty);
+    } else {
+        // Clamp to +-2^62, far beyond what a double counts exactly, so the
+        // i64 neither starts out of range nor overflows stepping past the
+        // limit.
+        BoundV = CG.CreateConversion(BoundV, DoubleTy);
+        if (!BoundV)
+            return nullptr;
+        Limit = CG.Builder.CreateCall(
+            llvm::Intrinsic::getDeclaration(CG.TheModule.get(),
+                                            llvm::Intrinsic::ceil, {DoubleTy}),
+            {BoundV}, "bound");
+        llvm::Value* Max = llvm::ConstantFP::get(DoubleTy, 4611686018427387904.0);
+        llvm::Value* Min = llvm::ConstantFP::get(DoubleTy, -4611686018427387904.0);
+        Limit = CG.Builder.CreateSelect(CG.Builder.CreateFCmpUGE(Limit, Max), Max, Limit);
+        Limit = CG.Builder.CreateSelect(CG.Builder.CreateFCmpOLT(Limit, Min), Min, Limit);
+        Limit = CG.Builder.CreateFPToSI(Limit, Int64Ty, "limit");
+    }
+
+    llvm::BasicBlock* PreheaderBB = CG.Builder.GetInsertBlock();
+    llvm::BasicBlock* AfterBB = llvm::BasicBlock::Create(CG.TheContext, "afterloop");
+
+    // A negative start could index below 0 however the loop ends.
+    CounterScope Scope = {nullptr, nullptr,
+                          CG.ElideBoundsChecks && L.Start >= 0, {}, false};
+    llvm::BasicBlock* LoopBB =
+        emitCounter(N, L, Limit, PreheaderBB, AfterBB, Scope);
+    if (!LoopBB)
         return nullptr;
-    Builder.CreateStore(StartV, Alloca);
 
-    llvm::BasicBlock* LoopBB = llvm::BasicBlock::Create(TheContext, "loop", TheFunction);
-    Builder.CreateBr(LoopBB);
-    Builder.SetInsertPoint(LoopBB);
+    if (Scope.HoldsVersionedLoop) {
+        for (auto& E : Scope.Elided)
+            insertBoundsCheck(E.first, E.second);
+        Scope.Elided.clear();
+    }
+
+    CG.Builder.SetInsertPoint(PreheaderBB);
+    if (Scope.Elided.empty()) {
+        CG.Builder.CreateBr(LoopBB);
+    } else {
+        llvm::BasicBlock* CheckedBB = emitCheckedCopy(LoopBB, Scope);
+        for (CounterScope* Outer : Counters)
+            Outer->HoldsVersionedLoop = true;
+
+        // The counter takes the values Start, Start + Step, ... up to the
+        // first that is not below Limit, so it stays below a length M if
+        // Start < M and Limit + Step <= M.  M - Step cannot overflow when
+        // Start < M, as Start is not negative.
+        llvm::SmallVector<llvm::Value*, 4> Lengths;
+        for (auto& E : Scope.Elided)
+            if (!llvm::is_contained(Lengths, E.second))
+                Lengths.push_back(E.second);
+        llvm::Value* InRange = CG.Builder.getTrue();
+        for (llvm::Value* Length : Lengths) {
+            llvm::Value* First = CG.Builder.CreateICmpSLT(
+                llvm::ConstantInt::get(Int64Ty, L.Start), Length);
+            llvm::Value* Last = CG.Builder.CreateICmpSLE(
+                Limit, CG.Builder.CreateSub(
+                           Length, llvm::ConstantInt::get(Int64Ty, L.Step)));
+            InRange = CG.Builder.CreateAnd(
+                InRange, CG.Builder.CreateAnd(First, Last), "inrange");
+        }
+        CG.Builder.CreateCondBr(InRange, LoopBB, CheckedBB);
+    }
+
+    TheFunction->getBasicBlockList().push_back(AfterBB);
+    CG.Builder.SetInsertPoint(AfterBB);
+    return llvm::ConstantFP::getNullValue(DoubleTy);
+}
+
+/// emitCounter - Emit the counted loop N, entered from PreheaderBB and left
+/// for AfterBB, with its body generated as Scope says.  Returns the loop's
+/// first block, or null if the body fails to generate.  The loop's blocks
+/// are the last in the function, but for TrapBB.
+llvm::BasicBlock* ExprCodeGen::emitCounter(ExprNode N, const CountedLoop& L,
+                                           llvm::Value* Limit,
+                                           llvm::BasicBlock* PreheaderBB,
+                                           llvm::BasicBlock* AfterBB,
+                                           CounterScope& Scope) {
+    Symbol VarName = N.A;
+    ExprIdx Body = Pool.getExtra(N.B, 4)[3];
+    llvm::Type* Int64Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
+
+    llvm::BasicBlock* LoopBB = llvm::BasicBlock::Create(CG.TheContext, "loop", TheFunction);
+    CG.Builder.SetInsertPoint(LoopBB);
+
+    llvm::PHINode* Counter = CG.Builder.CreatePHI(Int64Ty, 2, "counter");
+    Counter->addIncoming(llvm::ConstantInt::get(Int64Ty, L.Start), PreheaderBB);
+    llvm::Value* Variable = Counter;
+    if (N.Op == VT_Double)
+        Variable = CG.Builder.CreateSIToFP(Counter, llvm::Type::getDoubleTy(CG.TheContext),
+                                           CG.Symbols.name(VarName));
+    Scope.Var = Variable;
+    Scope.Counter = Counter;
+
+    size_t Names = CG.NamedValues.enterScope();
+    CG.NamedValues.bind(VarName, Variable);
+
+    Counters.push_back(&Scope);
+    llvm::Value* BodyV = visit(Body);
+    Counters.pop_back();
+    if (!BodyV)
+        return nullptr;
+
+    llvm::Value* Next = CG.Builder.CreateNSWAdd(
+        Counter, llvm::ConstantInt::get(Int64Ty, L.Step), "nextcounter");
+    Counter->addIncoming(Next, CG.Builder.GetInsertBlock());
+    llvm::Value* EndV = CG.Builder.CreateICmpSLT(Counter, Limit, "loopcond");
+    setLoopHints(CG.Builder.CreateCondBr(EndV, LoopBB, AfterBB), N);
+
+    CG.NamedValues.leaveScope(Names);
+    return LoopBB;
+}
+
+/// emitCheckedCopy - Copy the loop that starts at LoopBB, with the bounds
+/// checks Scope left out put back in the copy, and return the copy's first
+/// block.  The copies of loops get loop IDs of their own, and an element
+/// address an outer loop left unchecked is recorded for it in both copies.
+llvm::BasicBlock* ExprCodeGen::emitCheckedCopy(llvm::BasicBlock* LoopBB,
+                                               const CounterScope& Scope) {
+    llvm::Function* TheFunction = LoopBB->getParent();
+    llvm::SmallVector<llvm::BasicBlock*, 16> Blocks;
+    for (auto It = LoopBB->getIterator(); It != TheFunction->end(); ++It)
+        if (&*It != TrapBB)
+            Blocks.push_back(&*It);
+
+    llvm::ValueToValueMapTy VMap;
+    llvm::SmallVector<llvm::BasicBlock*, 16> Copies;
+    for (llvm::BasicBlock* BB : Blocks) {
+        llvm::BasicBlock* Copy = llvm::CloneBasicBlock(BB, VMap, ".checked", TheFunction);
+        VMap[BB] = Copy;
+        Copies.push_back(Copy);
+    }
+    llvm::remapInstructionsInBlocks(Copies, VMap);
+
+    for (llvm::BasicBlock* Copy : Copies) {
+        llvm::Instruction* Term = Copy->getTerminator();
+        if (llvm::MDNode* ID = Term->getMetadata(llvm::LLVMContext::MD_loop))
+            Term->setMetadata(llvm::LLVMContext::MD_loop, CopyLoopID(ID));
+    }
+    for (CounterScope* Outer : Counters) {
+        for (size_t i = 0, e = Outer->Elided.size(); i != e; ++i)
+            if (llvm::Value* Copy = VMap.lookup(Outer->Elided[i].first))
+                Outer->Elided.push_back({llvm::cast<llvm::GetElementPtrInst>(Copy),
+                                         Outer->Elided[i].second});
+    }
+    for (auto& E : Scope.Elided)
+        insertBoundsCheck(llvm::cast<llvm::GetElementPtrInst>(VMap[E.first]),
+                          E.second);
+    return Copies.front();
+}
+
+/// visitFor - Generate the for loop N.  The array accesses in the body of a
+/// simd loop go in an access group of its own, which setLoopHints declares
+/// parallel.
+llvm::Value* ExprCodeGen::visitFor(ExprNode N) {
+    if (!LoopHints::unpack(N.C).Simd)
+        return emitFor(N);
+    AccessGroups.push_back(llvm::MDNode::getDistinct(CG.TheContext, {}));
+    llvm::Value* V = emitFor(N);
+    AccessGroups.pop_back();
+    return V;
+}
+
+/// setLoopHints - Give Latch, the branch back to the top of the loop N, the
+/// llvm.loop metadata that N's hints ask for, if any.
+void ExprCodeGen::setLoopHints(llvm::BranchInst* Latch, ExprNode N) {
+    LoopHints H = LoopHints::unpack(N.C);
+    if (H.Simd)
+        Latch->setMetadata(llvm::LLVMContext::MD_loop,
+                           SimdLoopID(CG.TheContext, H, AccessGroups.back()));
+}
+
+/// addToAccessGroups - Put the array access Access in the access group of
+/// each simd loop it is in.
+void ExprCodeGen::addToAccessGroups(llvm::Instruction* Access) {
+    if (AccessGroups.empty())
+        return;
+    if (AccessGroups.size() == 1) {
+        Access->setMetadata(llvm::LLVMContext::MD_access_group, AccessGroups[0]);
+        return;
+    }
+    llvm::SmallVector<llvm::Metadata*, 2> Groups(AccessGroups.begin(),
+                                                 AccessGroups.end());
+    Access->setMetadata(llvm::LLVMContext::MD_access_group,
+                        llvm::MDNode::get(CG.TheContext, Groups));
+}
+
+llvm::Value* ExprCodeGen::emitFor(ExprNode N) {
+    CountedLoop L;
+    if (CG.IntegerLoops && isCountedLoop(N, L))
+        return emitCountedLoop(N, L);
+
+    Symbol VarName = N.A;
+    llvm::ArrayRef<uint32_t> Parts = Pool.getExtra(N.B, 4);
+    ExprIdx Start = Parts[0], End = Parts[1], Step = Parts[2], Body = Parts[3];
+
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
+    llvm::Type* VarTy = CG.getType(ValueType(N.Op));
+
+    // The loop variable is a phi in the loop block, unless the body assigns to
+    // it and it has to live in an alloca.
+    llvm::AllocaInst* Alloca = nullptr;
+    if (isAssigned(VarName))
+        Alloca = CG.CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+    
+    llvm::Value* StartV = visitLiteralAs(Start, VarTy);
+    if (!StartV || !(StartV = CG.CreateConversion(StartV, VarTy)))
+        return nullptr;
+    if (Alloca)
+        CG.Builder.CreateStore(StartV, Alloca);
+
+    llvm::BasicBlock* PreheaderBB = CG.Builder.GetInsertBlock();
+    llvm::BasicBlock* LoopBB = llvm::BasicBlock::Create(CG.TheContext, "loop", TheFunction);
+    CG.Builder.CreateBr(LoopBB);
+    CG.Builder.SetInsertPoint(LoopBB);
+
+    llvm::PHINode* Variable = nullptr;
+    if (!Alloca) {
+        Variable = CG.Builder.CreatePHI(VarTy, 2, CG.Symbols.name(VarName));
+        Variable->addIncoming(StartV, PreheaderBB);
+    }
 
-    llvm::AllocaInst* OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
+    size_t Scope = CG.NamedValues.enterScope();
+    if (Alloca)
+        CG.NamedValues.bind(VarName, Alloca);
+    else
+        CG.NamedValues.bind(VarName, Variable);
 
-    if (!Body->codegen())
+    if (!visit(Body))
         return nullptr;
 
     // // Emit the step value
     llvm::Value* StepV = nullptr;
-    if (Step) {
-        StepV = Step->codegen();
+    if (Step != NoExpr) {
+        StepV = visit(Step);
         if (!StepV)
             return nullptr;
     } else {
-        StepV = llvm::ConstantFP::get(TheContext, llvm::APFloat(1.0));
+        StepV = llvm::ConstantFP::get(CG.TheContext, llvm::APFloat(1.0));
     }
+    StepV = CG.CreateConversion(StepV, VarTy);
+    if (!StepV)
+        return nullptr;
 
     // Compute the end condition.
-    llvm::Value* EndV = End->codegen();
+    llvm::Value* EndV = visit(End);
     if (!EndV)
         return nullptr;
 
-    llvm::Value* CurVal  = Builder.CreateLoad(Alloca, VarName.c_str());
-    llvm::Value* NextVal = Builder.CreateFAdd(CurVal, StepV, "nextvar");
-    Builder.CreateStore(NextVal, Alloca);
+    llvm::Value* CurVal = Variable;
+    if (Alloca)
+        CurVal = CG.Builder.CreateLoad(Alloca, CG.Symbols.name(VarName));
+    llvm::Value* NextVal = VarTy->isFloatingPointTy()
+                               ? CG.Builder.CreateFAdd(CurVal, StepV, "nextvar")
+                               : CG.Builder.CreateAdd(CurVal, StepV, "nextvar");
+    if (Alloca)
+        CG.Builder.CreateStore(NextVal, Alloca);
+    else
+        Variable->addIncoming(NextVal, CG.Builder.GetInsertBlock());
 
-    EndV = Builder.CreateFCmpONE(EndV,
-        llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "loopcond");
+    EndV = CG.CreateConversion(EndV, llvm::Type::getInt1Ty(CG.TheContext));
+    if (!EndV)
+        return nullptr;
 
-    llvm::BasicBlock* AfterBB = llvm::BasicBlock::Create(TheContext, "afterloop", TheFunction);
+    llvm::BasicBlock* AfterBB = llvm::BasicBlock::Create(CG.TheContext, "afterloop", TheFunction);
 
-    Builder.CreateCondBr(EndV, LoopBB, AfterBB);
+    setLoopHints(CG.Builder.CreateCondBr(EndV, LoopBB, AfterBB), N);
 
     // Any new code will be inserted in AfterBB.
-    Builder.SetInsertPoint(AfterBB);
+    CG.Builder.SetInsertPoint(AfterBB);
 
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    CG.NamedValues.leaveScope(Scope);
 
-    return llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(TheContext));
+    return llvm::ConstantFP::getNullValue(llvm::Type::getDoubleTy(CG.TheContext));
 }
 
-llvm::Value* VarExprAST::codegen() {
-    std::vector<llvm::AllocaInst*> OldBindings;
+llvm::Value* ExprCodeGen::visitVar(ExprNode N) {
+    // (name, initializer, type) triples
+    llvm::ArrayRef<uint32_t> VarNames = Pool.getExtra(N.A, 3 * N.B);
+    ExprIdx Body = N.C;
+    size_t Scope = CG.NamedValues.enterScope();
     
-    llvm::Function* TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
 
-    for (unsigned i = 0, e = VarNames.size(); i < e; ++i) {
-        const std::string& VarName = VarNames[i].first;
-        ExprAST* Init = VarNames[i].second.get();
+    for (unsigned i = 0, e = N.B; i < e; ++i) {
+        Symbol VarName = VarNames[3 * i];
+        ExprIdx Init = VarNames[3 * i + 1];
+        llvm::Type* VarTy = CG.getType(ValueType(VarNames[3 * i + 2]));
 
         // Emit the initializer before adding the variable to scope, this prevents
         // the initializer from referencing the variable itself, and permits stuff
@@ -951,96 +2866,620 @@ llvm::Value* VarExprAST::codegen() {
         //  var a = 1 in
         //    var a = a in ...   # refers to outer 'a'.
         llvm::Value* InitV = nullptr;
-        if (Init) {
-            InitV = Init->codegen();
-            if (!InitV)
+        if (Init != NoExpr) {
+            InitV = visitLiteralAs(Init, VarTy);
+            if (!InitV || !(InitV = CG.CreateConversion(InitV, VarTy)))
                 return nullptr;
         } else {
-            InitV = llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0));
+            InitV = llvm::Constant::getNullValue(VarTy);
         }
 
-        llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-        Builder.CreateStore(InitV, Alloca);
+        if (!isAssigned(VarName)) {
+            CG.NamedValues.bind(VarName, InitV);
+            continue;
+        }
+        llvm::AllocaInst* Alloca = CG.CreateEntryBlockAlloca(TheFunction, VarName, VarTy);
+        CG.Builder.CreateStore(InitV, Alloca);
 
-        OldBindings.push_back(NamedValues[VarName]);
-        NamedValues[VarName] = Alloca;
+        CG.NamedValues.bind(VarName, Alloca);
     }
 
-    llvm::Value* BodyV = Body->codegen();
+    llvm::Value* BodyV = visit(Body, InTail);
     if (!BodyV)
         return nullptr;
 
-    for (unsigned i = 0, e = OldBindings.size(); i < e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    CG.NamedValues.leaveScope(Scope);
 
     return BodyV;
 }
 
-llvm::Function* PrototypeAST::codegen() {
-    std::vector<llvm::Type*> Doubles(Args.size(), llvm::Type::getDoubleTy(TheContext));
+/// bindArrayLengths - Record, for each parameter in Args that is an array
+/// with a length, that the value it is bound to in Values has the length
+/// its length parameter is bound to.  The checks trust those two values, so
+/// the body may assign to neither; that is an error, and gives false.
+bool ExprCodeGen::bindArrayLengths(llvm::ArrayRef<Symbol> Args,
+                                   llvm::ArrayRef<int> Lengths,
+                                   llvm::ArrayRef<llvm::Value*> Values) {
+    for (size_t i = 0; i != Args.size(); ++i) {
+        if (Lengths[i] < 0)
+            continue;
+        if (isAssigned(Args[i]) || isAssigned(Args[Lengths[i]])) {
+            char buf[128];
+            snprintf(buf, sizeof(buf), "cannot assign to array '%s' or its length",
+                     CG.Symbols.name(Args[i]).str().c_str());
+            LogError(buf);
+            return false;
+        }
+        ArrayLengths[Values[i]] = Values[Lengths[i]];
+    }
+    return true;
+}
 
-    llvm::FunctionType* FT =
-        llvm::FunctionType::get(llvm::Type::getDoubleTy(TheContext), Doubles, false);
+/// emitElementAddress - The address of the element of Array, the value of
+/// the variable N indexes, that N indexes.  An index is converted to int,
+/// and checked against the array's length if it has one, unless it is the
+/// variable of a counted loop that checks it for the whole loop.
+llvm::Value* ExprCodeGen::emitElementAddress(llvm::Value* Array, ExprNode N) {
+    if (!Array->getType()->isPointerTy()) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "'%s' is not an array",
+                 CG.Symbols.name(N.A).str().c_str());
+        return LogErrorV(buf);
+    }
+    llvm::Value* Length = ArrayLengths.lookup(Array);
+
+    llvm::Type* Int64Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    llvm::Value* Index = nullptr;
+    CounterScope* ElidedBy = nullptr;
+    if (Pool[N.B].Kind == EK_Variable) {
+        llvm::Value* Var = CG.NamedValues.lookup(Pool[N.B].A);
+        for (auto It = Counters.rbegin(), E = Counters.rend(); Var && It != E; ++It) {
+            CounterScope& C = **It;
+            if (C.Var != Var)
+                continue;
+            Index = C.Counter;
+            if (Length && C.Unchecked)
+                ElidedBy = &C;
+            break;
+        }
+    }
+    if (!Index) {
+        Index = visitLiteralAs(N.B, Int64Ty);
+        if (!Index || !(Index = CG.CreateConversion(Index, Int64Ty)))
+            return nullptr;
+    }
 
-    llvm::Function* F = 
-        llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
+    if (Length && !ElidedBy)
+        emitBoundsCheck(Index, Length);
+    llvm::Value* Addr = CG.Builder.CreateInBoundsGEP(
+        Array->getType()->getPointerElementType(), Array, Index, "elt");
+    if (ElidedBy)
+        ElidedBy->Elided.push_back({llvm::cast<llvm::GetElementPtrInst>(Addr), Length});
+    return Addr;
+}
 
-    unsigned Idx = 0;
-    for (auto& Arg : F->args())
-        Arg.setName(Args[Idx++]);
+/// emitBoundsCheck - Trap unless 0 <= Index < Length.
+void ExprCodeGen::emitBoundsCheck(llvm::Value* Index, llvm::Value* Length) {
+    llvm::BasicBlock* OkBB = llvm::BasicBlock::Create(
+        CG.TheContext, "inbounds", CG.Builder.GetInsertBlock()->getParent());
+    branchIfInBounds(Index, Length, OkBB);
+    CG.Builder.SetInsertPoint(OkBB);
+}
 
-    return F;
+/// insertBoundsCheck - Put the check that emitElementAddress left out of Addr
+/// back in front of it.
+void ExprCodeGen::insertBoundsCheck(llvm::GetElementPtrInst* Addr,
+                                    llvm::Value* Length) {
+    llvm::BasicBlock* BB = Addr->getParent();
+    llvm::BasicBlock* OkBB = BB->splitBasicBlock(Addr, "inbounds");
+    BB->getTerminator()->eraseFromParent();
+    llvm::IRBuilderBase::InsertPointGuard Guard(CG.Builder);
+    CG.Builder.SetInsertPoint(BB);
+    branchIfInBounds(Addr->getOperand(1), Length, OkBB);
 }
 
-llvm::Function* FunctionAST::codegen() {
-    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-    // reference to it for use below.
-    auto& P = *Proto;
-    std::string Name = Proto->getName();
-    FunctionProtos[Name] = std::move(Proto);
-    llvm::Function* TheFunction = getFunction(Name);
+/// branchIfInBounds - End the current block with a branch to OkBB if
+/// 0 <= Index < Length, else to the trap.  The checks of a body share one
+/// trap block, and are weighted as all but never failing.
+void ExprCodeGen::branchIfInBounds(llvm::Value* Index, llvm::Value* Length,
+                                   llvm::BasicBlock* OkBB) {
+    llvm::Function* TheFunction = CG.Builder.GetInsertBlock()->getParent();
+    if (!TrapBB) {
+        TrapBB = llvm::BasicBlock::Create(CG.TheContext, "outofbounds", TheFunction);
+        llvm::IRBuilder<> TrapBuilder(TrapBB);
+        TrapBuilder.CreateCall(llvm::Intrinsic::getDeclaration(
+            CG.TheModule.get(), llvm::Intrinsic::trap));
+        TrapBuilder.CreateUnreachable();
+    }
 
-    if (!TheFunction)
-        return nullptr;
+    llvm::Value* InBounds = CG.Builder.CreateAnd(
+        CG.Builder.CreateICmpSGE(Index, llvm::ConstantInt::get(Index->getType(), 0)),
+        CG.Builder.CreateICmpSLT(Index, Length), "inbounds");
+    CG.Builder.CreateCondBr(InBounds, OkBB, TrapBB,
+                            llvm::MDBuilder(CG.TheContext).createBranchWeights(1 << 20, 1));
+}
 
-    if (P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+llvm::Value* ExprCodeGen::visitIndex(ExprNode N) {
+    llvm::Value* Array = visitVariable({EK_Variable, 0, N.A, 0, 0});
+    if (!Array)
+        return nullptr;
+    if (Array->getType()->isVectorTy())
+        return emitLane(Array, N.B);
+    llvm::Value* Addr = emitElementAddress(Array, N);
+    if (!Addr)
+        return nullptr;
+    llvm::LoadInst* Load = CG.Builder.CreateLoad(Addr, "elt");
+    Load->setMetadata(llvm::LLVMContext::MD_tbaa,
+                      ElementAccessTag(CG.TheContext, Load->getType()));
+    addToAccessGroups(Load);
+    return Load;
+}
+
+/// emitLane - Lane Index of Vector.  A constant index must be one of its
+/// lanes; any other is checked when it runs, like an array index.
+llvm::Value* ExprCodeGen::emitLane(llvm::Value* Vector, ExprIdx Index) {
+    llvm::Type* Int64Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    unsigned Lanes =
+        llvm::cast<llvm::FixedVectorType>(Vector->getType())->getNumElements();
+    llvm::Value* IndexV = visitLiteralAs(Index, Int64Ty);
+    if (!IndexV || !(IndexV = CG.CreateConversion(IndexV, Int64Ty)))
+        return nullptr;
+    if (auto* C = llvm::dyn_cast<llvm::ConstantInt>(IndexV)) {
+        if (C->getValue().uge(Lanes))
+            return LogErrorV("the vector has no such lane");
+    } else {
+        emitBoundsCheck(IndexV, llvm::ConstantInt::get(Int64Ty, Lanes));
+    }
+    return CG.Builder.CreateExtractElement(Vector, IndexV, "lane");
+}
+
+/// visitVector - A vector of doubles, from one element for every lane or
+/// from an element for each.
+llvm::Value* ExprCodeGen::visitVector(ExprNode N) {
+    llvm::Type* DoubleTy = llvm::Type::getDoubleTy(CG.TheContext);
+    llvm::ArrayRef<uint32_t> Elts = Pool.getExtra(N.A, N.B);
+    llvm::Value* V = llvm::UndefValue::get(llvm::FixedVectorType::get(DoubleTy, N.Op));
+    for (unsigned i = 0, e = Elts.size(); i != e; ++i) {
+        llvm::Value* Elt = visit(Elts[i]);
+        if (!Elt || !(Elt = CG.CreateConversion(Elt, DoubleTy)))
+            return nullptr;
+        if (e == 1)
+            return CG.Builder.CreateVectorSplat(N.Op, Elt, "splat");
+        V = CG.Builder.CreateInsertElement(V, Elt, i, "vec");
+    }
+    return V;
+}
+
+/// emitVectorBuiltin - The call N to the VectorBuiltin Kind.  select
+/// converts its values as an if converts its branches, and then its
+/// condition to a mask of as many lanes, or to a bool that picks either
+/// whole value.  hsum, hmin and hmax reduce the doubles of a vector, and
+/// any and all the bools of a mask.
+llvm::Value* ExprCodeGen::emitVectorBuiltin(VectorBuiltin Kind, ExprNode N) {
+    llvm::ArrayRef<uint32_t> Args = Pool.getExtra(N.B, N.C);
+    if (Args.size() != (Kind == VB_Select ? 3u : 1u)) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "Incorrect # arguments passed when call function: '%s'",
+                 CG.Symbols.name(N.A).str().c_str());
+        return LogErrorV(buf);
+    }
+    llvm::SmallVector<llvm::Value*, 3> ArgsV;
+    for (ExprIdx Arg : Args) {
+        llvm::Value* ArgV = visit(Arg);
+        if (!ArgV)
+            return nullptr;
+        ArgsV.push_back(ArgV);
+    }
+
+    if (Kind == VB_Select) {
+        llvm::Value *Cond = ArgsV[0], *A = ArgsV[1], *B = ArgsV[2];
+        llvm::Type* Ty = TypeRank(A->getType()) >= TypeRank(B->getType())
+                             ? A->getType() : B->getType();
+        llvm::Type* CondTy = llvm::Type::getInt1Ty(CG.TheContext);
+        if (auto* VecTy = llvm::dyn_cast<llvm::FixedVectorType>(Cond->getType())) {
+            if (!Ty->isVectorTy())
+                Ty = llvm::FixedVectorType::get(llvm::Type::getDoubleTy(CG.TheContext),
+                                                VecTy->getNumElements());
+            CondTy = llvm::FixedVectorType::get(
+                CondTy, llvm::cast<llvm::FixedVectorType>(Ty)->getNumElements());
+        }
+        if (!(A = CG.CreateConversion(A, Ty)) || !(B = CG.CreateConversion(B, Ty)) ||
+            !(Cond = CG.CreateConversion(Cond, CondTy)))
+            return nullptr;
+        return CG.Builder.CreateSelect(Cond, A, B, "select");
+    }
+
+    auto* VecTy = llvm::dyn_cast<llvm::FixedVectorType>(ArgsV[0]->getType());
+    if (!VecTy) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "'%s' reduces a vector",
+                 CG.Symbols.name(N.A).str().c_str());
+        return LogErrorV(buf);
+    }
+    llvm::Type* DoubleTy = llvm::Type::getDoubleTy(CG.TheContext);
+    llvm::Type* LaneTy = Kind == VB_Any || Kind == VB_All
+                             ? llvm::Type::getInt1Ty(CG.TheContext) : DoubleTy;
+    llvm::Value* V = CG.CreateConversion(
+        ArgsV[0], llvm::FixedVectorType::get(LaneTy, VecTy->getNumElements()));
+    if (!V)
+        return nullptr;
+    switch (Kind) {
+        case VB_HSum:
+            return CG.Builder.CreateFAddReduce(llvm::ConstantFP::get(DoubleTy, -0.0), V);
+        case VB_HMin: return CG.Builder.CreateFPMinReduce(V);
+        case VB_HMax: return CG.Builder.CreateFPMaxReduce(V);
+        case VB_Any:  return CG.Builder.CreateOrReduce(V);
+        case VB_All:  return CG.Builder.CreateAndReduce(V);
+        default:      llvm_unreachable("not a reduction");
+    }
+}
+
+/// SetEffectAttrs - Give F exactly the attributes that FX allows.
+static void SetEffectAttrs(llvm::Function* F, const FunctionEffects& FX) {
+    bool ReadNone = FX.NoReads && FX.NoWrites;
+    std::pair<bool, llvm::Attribute::AttrKind> Attrs[] = {
+        {ReadNone, llvm::Attribute::ReadNone},
+        {!ReadNone && FX.NoWrites, llvm::Attribute::ReadOnly},
+        {!ReadNone && FX.NoReads, llvm::Attribute::WriteOnly},
+        {!ReadNone && FX.ArgMemOnly, llvm::Attribute::ArgMemOnly},
+        {FX.NoUnwind, llvm::Attribute::NoUnwind},
+        {FX.NoRecurse, llvm::Attribute::NoRecurse}};
+    for (auto& A : Attrs) {
+        if (A.first)
+            F->addFnAttr(A.second);
+        else
+            F->removeFnAttr(A.second);
+    }
+}
+
+llvm::Function* PrototypeAST::codegen(CodeGen& CG) {
+    std::vector<llvm::Type*> ArgTys;
+    for (ValueType Ty : ArgTypes)
+        ArgTys.push_back(CG.getType(Ty));
+
+    llvm::FunctionType* FT =
+        llvm::FunctionType::get(CG.getType(ReturnType), ArgTys, false);
+
+    llvm::Function* F = llvm::Function::Create(
+        FT, llvm::Function::ExternalLinkage, CG.Symbols.name(Name), CG.TheModule.get());
+    CG.ModuleFunctions[Name] = F;
+
+    // A bool argument is widened the way C passes a bool.
+    unsigned Idx = 0;
+    for (auto& Arg : F->args()) {
+        Arg.setName(CG.Symbols.name(Args[Idx++]));
+        if (Arg.getType()->isIntegerTy(1))
+            Arg.addAttr(llvm::Attribute::ZExt);
+    }
+
+    // With these, LLVM may reuse the result of an earlier call with the same
+    // arguments, hoist calls out of loops and drop calls whose result is not
+    // used.  This runs for each module that declares F, so a function defined
+    // in one JIT module carries its attributes into the modules that call it.
+    // An extern is declared before its prototype is recorded, so its "pure"
+    // is taken from here.
+    FunctionEffects FX = CG.getEffects(Name);
+    if (Pure && !CG.Effects.count(Name)) {
+        FX.setReadNone();
+        FX.NoUnwind = true;
+    }
+    SetEffectAttrs(F, FX);
+    if (Pure)
+        F->addFnAttr(llvm::Attribute::WillReturn);
+
+    return F;
+}
+
+/// MemoEntries - The number of entries in each memoized function's cache; a
+/// power of two.
+static const unsigned MemoEntries = 1024;
+
+/// MemoEntryType - One cache entry of F: the bit patterns of its arguments,
+/// its result, and whether the entry is filled.
+static llvm::StructType* MemoEntryType(CodeGen& CG, llvm::Function* F) {
+    llvm::Type* Int64Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    return llvm::StructType::get(CG.TheContext,
+                                 {llvm::ArrayType::get(Int64Ty, F->arg_size()),
+                                  F->getReturnType(),
+                                  llvm::Type::getInt1Ty(CG.TheContext)});
+}
+
+/// MemoKey - The bit pattern of Arg, widened to an i64.  An array is keyed
+/// by its address.
+static llvm::Value* MemoKey(CodeGen& CG, llvm::Argument& Arg) {
+    llvm::Type* Ty = Arg.getType();
+    llvm::Value* Bits = &Arg;
+    if (Ty->isPointerTy())
+        return CG.Builder.CreatePtrToInt(Bits, CG.Builder.getInt64Ty());
+    if (Ty->isFloatingPointTy())
+        Bits = CG.Builder.CreateBitCast(
+            Bits, CG.Builder.getIntNTy(Ty->getScalarSizeInBits()));
+    return CG.Builder.CreateZExtOrBitCast(Bits, CG.Builder.getInt64Ty());
+}
+
+/// EmitMemoLookup - Begin the memoized function F: hash the bits of its
+/// arguments to an entry of its cache, a zeroed global of MemoEntries entries
+/// in F's module, and return the result stored there if the entry holds
+/// these same arguments.  Code after this runs on a miss.  Returns the entry,
+/// for EmitMemoStore.  The cache is direct mapped: a colliding call just
+/// replaces the entry.
+static llvm::Value* EmitMemoLookup(CodeGen& CG, llvm::Function* F) {
+    llvm::Type* Int64Ty = llvm::Type::getInt64Ty(CG.TheContext);
+    llvm::StructType* EntryTy = MemoEntryType(CG, F);
+    llvm::ArrayType* CacheTy = llvm::ArrayType::get(EntryTy, MemoEntries);
+    auto* Cache = new llvm::GlobalVariable(
+        *CG.TheModule, CacheTy, false, llvm::GlobalValue::InternalLinkage,
+        llvm::Constant::getNullValue(CacheTy), F->getName() + ".memo");
+
+    // Fibonacci hashing: the top bits of a multiply by 2^64 / phi.
+    llvm::Value* Hash = llvm::ConstantInt::get(Int64Ty, 0);
+    for (auto& Arg : F->args()) {
+        Hash = CG.Builder.CreateMul(CG.Builder.CreateXor(Hash, MemoKey(CG, Arg)),
+                                    llvm::ConstantInt::get(Int64Ty, 0x9E3779B97F4A7C15ULL));
+    }
+    llvm::Value* Slot = CG.Builder.CreateLShr(Hash, 64 - llvm::Log2_32(MemoEntries));
+    llvm::Value* Entry = CG.Builder.CreateInBoundsGEP(
+        CacheTy, Cache, {llvm::ConstantInt::get(Int64Ty, 0), Slot}, "memoentry");
+
+    llvm::Value* Hit = CG.Builder.CreateLoad(
+        CG.Builder.CreateStructGEP(EntryTy, Entry, 2), "memofull");
+    unsigned Idx = 0;
+    for (auto& Arg : F->args()) {
+        llvm::Value* Key = CG.Builder.CreateLoad(CG.Builder.CreateInBoundsGEP(
+            EntryTy, Entry, {CG.Builder.getInt32(0), CG.Builder.getInt32(0),
+                             CG.Builder.getInt32(Idx++)}));
+        Hit = CG.Builder.CreateAnd(
+            Hit, CG.Builder.CreateICmpEQ(Key, MemoKey(CG, Arg)));
+    }
+
+    llvm::BasicBlock* HitBB = llvm::BasicBlock::Create(CG.TheContext, "memohit", F);
+    llvm::BasicBlock* MissBB = llvm::BasicBlock::Create(CG.TheContext, "memomiss", F);
+    CG.Builder.CreateCondBr(Hit, HitBB, MissBB);
+
+    CG.Builder.SetInsertPoint(HitBB);
+    CG.Builder.CreateRet(CG.Builder.CreateLoad(
+        CG.Builder.CreateStructGEP(EntryTy, Entry, 1), "memoval"));
+
+    CG.Builder.SetInsertPoint(MissBB);
+    return Entry;
+}
+
+/// EmitMemoStore - Fill F's cache entry Entry with its arguments and Result.
+static void EmitMemoStore(CodeGen& CG, llvm::Function* F, llvm::Value* Entry,
+                          llvm::Value* Result) {
+    llvm::StructType* EntryTy = MemoEntryType(CG, F);
+    unsigned Idx = 0;
+    for (auto& Arg : F->args())
+        CG.Builder.CreateStore(
+            MemoKey(CG, Arg),
+            CG.Builder.CreateInBoundsGEP(
+                EntryTy, Entry, {CG.Builder.getInt32(0), CG.Builder.getInt32(0),
+                                 CG.Builder.getInt32(Idx++)}));
+    CG.Builder.CreateStore(Result, CG.Builder.CreateStructGEP(EntryTy, Entry, 1));
+    CG.Builder.CreateStore(CG.Builder.getTrue(),
+                           CG.Builder.CreateStructGEP(EntryTy, Entry, 2));
+}
+
+/// CollectCallees - The functions and user defined operators that a function
+/// body calls.  The pool is flat, so this is one pass over its nodes.
+static std::vector<Symbol> CollectCallees(const ExprPool& Pool,
+                                          SymbolTable& Symbols) {
+    std::vector<Symbol> Callees;
+    for (ExprIdx E = 0, End = Pool.size(); E != End; ++E) {
+        const ExprNode& N = Pool[E];
+        switch (N.Kind) {
+            case EK_Call: Callees.push_back(N.A); break;
+            case EK_Unary: Callees.push_back(Symbols.operatorSymbol(false, N.Op)); break;
+            case EK_Binary:
+                if (!strchr("=<+-*", N.Op))
+                    Callees.push_back(Symbols.operatorSymbol(true, N.Op));
+                break;
+            default: break;
+        }
+    }
+    llvm::sort(Callees);
+    Callees.erase(std::unique(Callees.begin(), Callees.end()), Callees.end());
+    return Callees;
+}
+
+/// SetFastMathAttrs - Tell the backend which IEEE guarantees F's arithmetic
+/// may ignore, matching the flags on its instructions.
+static void SetFastMathAttrs(llvm::Function* F, llvm::FastMathFlags FMF) {
+    if (FMF.noNaNs())
+        F->addFnAttr("no-nans-fp-math", "true");
+    if (FMF.noInfs())
+        F->addFnAttr("no-infs-fp-math", "true");
+    if (FMF.isFast()) {
+        F->addFnAttr("no-signed-zeros-fp-math", "true");
+        F->addFnAttr("unsafe-fp-math", "true");
+    }
+}
+
+/// CallsItself - Whether any call in Pool is to Name.
+static bool CallsItself(const ExprPool& Pool, Symbol Name) {
+    for (ExprIdx E = 0, End = Pool.size(); E != End; ++E)
+        if (Pool[E].Kind == EK_Call && Pool[E].A == Name)
+            return true;
+    return false;
+}
+
+/// IndexesArrays - Whether Pool loads an array element, and whether it
+/// stores one.  The element an assignment stores to is not loaded.
+static void IndexesArrays(const ExprPool& Pool, bool& Loads, bool& Stores) {
+    unsigned Indexes = 0, Assigns = 0;
+    for (ExprIdx E = 0, End = Pool.size(); E != End; ++E) {
+        const ExprNode& N = Pool[E];
+        if (N.Kind == EK_Index)
+            ++Indexes;
+        else if (N.Kind == EK_Binary && N.Op == '=' && Pool[N.A].Kind == EK_Index)
+            ++Assigns;
+    }
+    Loads = Indexes > Assigns;
+    Stores = Assigns != 0;
+}
+
+llvm::Function* FunctionAST::codegen(CodeGen& CG) {
+    if (CG.SimplifyAST)
+        SimplifyExprs(Pool);
+    CG.Builder.setFastMathFlags(CG.FastMath);
+
+    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
+    // reference to it for use below.
+    auto& P = CG.SetFunctionProto(std::move(Proto));
+    Symbol Name = P.getName();
+    // A function that indexes arrays depends on more than its arguments, so
+    // it is never memoized, and pure or not it reads or writes memory.  Nor
+    // is one whose arguments do not fit in a memo key.
+    bool LoadsArrays, StoresArrays;
+    IndexesArrays(Pool, LoadsArrays, StoresArrays);
+    bool Memoize = CG.MemoizePure && P.isPure() && CallsItself(Pool, Name) &&
+                   !LoadsArrays && !StoresArrays &&
+                   llvm::none_of(P.getArgTypes(), isVectorType);
+
+    // Apart from array elements, the body keeps its values in allocas and
+    // touches no other memory, so a function can do what the functions it
+    // calls can do and no more.  Those are all compiled already, so one pass
+    // over the callees is enough; a call to an extern that is defined later
+    // counts as a call to unknown code.  "pure" promises readnone and
+    // nounwind whatever the body calls, but a memoized function writes its
+    // cache.  Array elements are reached through the array arguments, so a
+    // body that indexes them stays argmemonly, unless a callee returned the
+    // array, which may point anywhere.
+    FunctionEffects FX;
+    FX.setReadNone();
+    FX.NoUnwind = true;
+    FX.CallsUnknown = false;
+    bool CallsSelf = false, ArraysFromCalls = false;
+    for (Symbol Callee : CollectCallees(Pool, CG.Symbols)) {
+        if (Callee == Name)
+            CallsSelf = true;
+        else if (!BuiltinOf(Callee))
+            FX.meet(CG.getEffects(Callee));
+        if (Callee < CG.FunctionProtos.size() && CG.FunctionProtos[Callee] &&
+            isArrayType(CG.FunctionProtos[Callee]->getReturnType()))
+            ArraysFromCalls = true;
+    }
+    // Code compiled before this function cannot call it, unless it is a new
+    // definition of a name that older code may already call.
+    FX.NoRecurse = !CallsSelf && !FX.CallsUnknown && !CG.Effects.count(Name);
+    if (P.isPure()) {
+        FX.setReadNone();
+        FX.NoUnwind = true;
+    }
+    if (Memoize)
+        FX.NoReads = FX.NoWrites = FX.ArgMemOnly = false;
+    FX.NoReads &= !LoadsArrays;
+    FX.NoWrites &= !StoresArrays;
+    FX.ArgMemOnly &= !ArraysFromCalls;
+
+    llvm::Function* TheFunction = CG.getFunction(Name);
+
+    if (!TheFunction)
+        return nullptr;
 
     if (!TheFunction->empty()) {
         char buf[128];
-        sprintf(buf, "Function '%s' cannot be redefined.", Proto->getName().c_str());
+        snprintf(buf, sizeof(buf), "Function '%s' cannot be redefined.",
+                 CG.Symbols.name(Name).str().c_str());
         return (llvm::Function*)LogErrorV(buf);
     }
+    SetEffectAttrs(TheFunction, FX);
+    SetFastMathAttrs(TheFunction, CG.FastMath);
+
+    // Install the operator's precedence, remembering the old one in case the
+    // body fails to generate.
+    int OldPrecedence = 0;
+    if (P.isBinaryOp())
+        OldPrecedence = CG.BinopPrecedence.set(P.getOperatorName(CG.Symbols),
+                                               P.getBinaryPrecedence());
 
-    llvm::BasicBlock* BB = llvm::BasicBlock::Create(TheContext, "entry", TheFunction);
-    Builder.SetInsertPoint(BB);
+    // Uses of an operator inside its own definition are calls to the function
+    // being defined, not the previous definition inlined.
+    auto OldBody = CG.OperatorBodies.find(Name);
+    if (OldBody != CG.OperatorBodies.end())
+        OldBody->second.Inlining = true;
 
-    NamedValues.clear();
-    // for (auto& Arg : TheFunction->args())
-        // NamedValues[Arg.getName()] = &Arg;
+    llvm::BasicBlock* BB = llvm::BasicBlock::Create(CG.TheContext, "entry", TheFunction);
+    CG.Builder.SetInsertPoint(BB);
+
+    CG.NamedValues.clear();
+    TailCallLoop Loop;
+    ExprCodeGen BodyGen(CG, Pool, &Loop);
+
+    // Parameters the body assigns to live in allocas; the others are just the
+    // arguments, or phis in the tail call loop below.
+    unsigned Idx = 0;
     for (auto& Arg : TheFunction->args()) {
-        llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
-        Builder.CreateStore(&Arg, Alloca);
-        NamedValues[Arg.getName()] = Alloca;
+        Symbol ArgName = P.getArgs()[Idx++];
+        if (!BodyGen.isAssigned(ArgName)) {
+            Loop.Params.push_back(&Arg);
+            continue;
+        }
+        llvm::AllocaInst* Alloca =
+            CG.CreateEntryBlockAlloca(TheFunction, ArgName, Arg.getType());
+        CG.Builder.CreateStore(&Arg, Alloca);
+        Loop.Params.push_back(Alloca);
     }
 
-    if (llvm::Value* RetVal = Body->codegen()) {
+    // A pure function that calls itself, like a naive fib, would compute the
+    // same calls over and over; remember each result instead.
+    llvm::Value* MemoEntry = nullptr;
+    if (Memoize)
+        MemoEntry = EmitMemoLookup(CG, TheFunction);
+
+    // A function that calls itself gets a block to come back to after its
+    // parameters are set up, so that self calls in tail position become jumps
+    // whatever passes run, and deep recursion runs in one stack frame.
+    if (CG.SelfTailCalls && CallsItself(Pool, Name)) {
+        llvm::BasicBlock* PreheaderBB = CG.Builder.GetInsertBlock();
+        Loop.Self = Name;
+        Loop.Header = llvm::BasicBlock::Create(CG.TheContext, "tailrecurse", TheFunction);
+        CG.Builder.CreateBr(Loop.Header);
+        CG.Builder.SetInsertPoint(Loop.Header);
+        for (llvm::Value*& Param : Loop.Params) {
+            if (llvm::isa<llvm::AllocaInst>(Param))
+                continue;
+            llvm::PHINode* PN = CG.Builder.CreatePHI(
+                Param->getType(), 2, Param->getName());
+            PN->addIncoming(Param, PreheaderBB);
+            Param = PN;
+        }
+    }
+
+    for (size_t i = 0, e = Loop.Params.size(); i != e; ++i)
+        CG.NamedValues.bind(P.getArgs()[i], Loop.Params[i]);
+
+    llvm::Value* RetVal = nullptr;
+    if (BodyGen.bindArrayLengths(P.getArgs(), P.getArgLengths(), Loop.Params))
+        RetVal = BodyGen.visitLiteralAs(Body, TheFunction->getReturnType(), true);
+    if (RetVal)
+        RetVal = CG.CreateConversion(RetVal, TheFunction->getReturnType());
+    if (RetVal) {
         // Finish off the function.
-        Builder.CreateRet(RetVal);
+        if (MemoEntry)
+            EmitMemoStore(CG, TheFunction, MemoEntry, RetVal);
+        CG.Builder.CreateRet(RetVal);
 
         // Validate the generated code, checking for consistency.
         llvm::verifyFunction(*TheFunction);
 
         // Optimize the function.
-        TheFPM->run(*TheFunction);
+        CG.TheFPM->run(*TheFunction);
 
+        if (P.isUnaryOp() || P.isBinaryOp())
+            CG.OperatorBodies[Name] = {Pool, Body, P.getArgs(), P.getArgTypes(),
+                                       P.getArgLengths(), P.getReturnType()};
+        CG.Effects[Name] = FX;
         return TheFunction;
     }
 
     // Error reading body, remove function.
+    CG.ModuleFunctions.erase(Name);
     TheFunction->eraseFromParent();
     if (P.isBinaryOp())
-        BinopPrecedence.erase(P.getOperatorName());
+        CG.BinopPrecedence.set(P.getOperatorName(CG.Symbols), OldPrecedence);
+    if (OldBody != CG.OperatorBodies.end())
+        OldBody->second.Inlining = false;
     return nullptr;
 }
 
@@ -1048,90 +3487,548 @@ llvm::Function* FunctionAST::codegen() {
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
-static void InitializeModuleAndPassManager() {
+namespace {
+
+/// ParsedItem - A top-level item parsed ahead of code generation: a def or a
+/// top-level expression in Fn, or an extern in Extern.  End is the index of
+/// the token after it.
+struct ParsedItem {
+    int Kind; // tok_def, tok_extern, or 0 for a top-level expression.
+    std::unique_ptr<FunctionAST> Fn;
+    std::unique_ptr<PrototypeAST> Extern;
+    size_t End;
+};
+
+/// ParseBatch - The top-level items in tokens [Begin, End), which one thread
+/// parses.  Precedence holds the binary operators defined before Begin.  If
+/// an item fails to parse the batch stops there, at ErrorTokIdx.
+struct ParseBatch {
+    static const size_t NoError = SIZE_MAX;
+
+    ParseBatch(size_t Begin, const PrecedenceTable& Precedence)
+        : Begin(Begin), Precedence(Precedence) { }
+
+    size_t Begin, End = 0;
+    PrecedenceTable Precedence;
+    std::vector<ParsedItem> Items;
+    size_t ErrorTokIdx = NoError;
+};
+
+/// ParallelParser - Parses a fully lexed input on several threads.  A prescan
+/// cuts the tokens into batches at def and extern, which can only start a
+/// top-level item, and follows each "def binary<op> <prec>" on the way so that
+/// every batch starts with the precedences in effect where it begins.  Each
+/// thread then takes batches and parses them with a Parser and PrecedenceTable
+/// of its own; the token stream and symbol table are only read.
+///
+/// The ASTs are the ones parsing the items in order would give, as long as
+/// every item parses and every binary operator definition installs its
+/// precedence when its code is generated.  ParallelMainLoop checks both.
+class ParallelParser {
+public:
+    ParallelParser(TokenStream& Tokens, SymbolTable& Symbols,
+                   const PrecedenceTable& BinopPrecedence)
+        : Tokens(Tokens), Symbols(Symbols), BinopPrecedence(BinopPrecedence) { }
+
+    /// parse - Parse the tokens from Begin to tok_eof on Jobs threads.
+    void parse(size_t Begin, unsigned Jobs);
+
+    std::vector<ParseBatch> Batches;
+
+private:
+    void prescan(size_t Begin, unsigned NumBatches);
+    void parseBatch(ParseBatch& B);
+
+    TokenStream& Tokens;
+    SymbolTable& Symbols;
+    const PrecedenceTable& BinopPrecedence;
+};
+
+} // end anonymous namespace
+
+/// prescan - Cut the tokens from Begin on into about NumBatches batches.
+void ParallelParser::prescan(size_t Begin, unsigned NumBatches) {
+    size_t NumTokens = Tokens.size(); // The last one is tok_eof.
+    size_t BatchSize = (NumTokens - Begin) / NumBatches + 1;
+    PrecedenceTable Precedence = BinopPrecedence;
+
+    Batches.clear();
+    Batches.emplace_back(Begin, Precedence);
+    for (size_t I = Begin; I + 1 < NumTokens; ++I) {
+        int Tok = Tokens.getKind(I);
+        if ((Tok == tok_def || Tok == tok_extern) &&
+            I - Batches.back().Begin >= BatchSize) {
+            Batches.back().End = I;
+            Batches.emplace_back(I, Precedence);
+        }
+        if (Tok != tok_unary && Tok != tok_binary)
+            continue;
+
+        // Intern the operator's function name now rather than have
+        // ParsePrototype do it on some thread.
+        int Op = Tokens.getKind(I + 1);
+        if (!isascii(Op))
+            continue;
+        Symbols.operatorSymbol(Tok == tok_binary, (char)Op);
+
+        // The precedence is ParsePrototype's default unless a number follows.
+        size_t Def = I - 1;
+        if (Def > Begin && Tokens.getKind(Def) == tok_pure)
+            --Def;
+        if (Tok != tok_binary || I == Begin || Tokens.getKind(Def) != tok_def)
+            continue;
+        double Prec = 30;
+        if (Tokens.getKind(I + 2) == tok_number)
+            Prec = Tokens.getNumber(I + 2);
+        if (Prec >= 1 && Prec <= 100)
+            Precedence.set((char)Op, (unsigned)Prec);
+    }
+    Batches.back().End = NumTokens - 1;
+}
+
+void ParallelParser::parse(size_t Begin, unsigned Jobs) {
+    // A few batches per thread keep every thread busy to the end.
+    prescan(Begin, Jobs > 1 ? Jobs * 4 : 1);
+
+    std::atomic<size_t> NextBatch(0);
+    auto Work = [&] {
+        QuietErrors = true;
+        for (size_t B; (B = NextBatch++) < Batches.size();)
+            parseBatch(Batches[B]);
+        QuietErrors = false;
+    };
+
+    std::vector<std::thread> Threads;
+    for (unsigned i = 1; i < Jobs; ++i)
+        Threads.emplace_back(Work);
+    Work();
+    for (std::thread& T : Threads)
+        T.join();
+}
+
+/// parseBatch - Parse one batch the way MainLoop would, installing binary
+/// operator precedences as their definitions are parsed since there is no
+/// codegen to do it.
+void ParallelParser::parseBatch(ParseBatch& B) {
+    PrecedenceTable Precedence = B.Precedence;
+    Parser P(Tokens, Symbols, Precedence);
+    P.seek(B.Begin, B.End);
+    while (P.CurTok != tok_eof) {
+        size_t Start = P.getTokIdx();
+        ParsedItem Item;
+        Item.Kind = P.CurTok;
+        switch (P.CurTok) {
+            case ';': P.getNextToken(); continue;
+            case tok_def: Item.Fn = P.ParseDefinition(); break;
+            case tok_extern: Item.Extern = P.ParseExtern(); break;
+            default: Item.Kind = 0; Item.Fn = P.ParseTopLevelExpr(); break;
+        }
+        if (!Item.Fn && !Item.Extern) {
+            B.ErrorTokIdx = Start;
+            return;
+        }
+
+        if (Item.Kind == tok_def && Item.Fn->getProto().isBinaryOp()) {
+            const PrototypeAST& Proto = Item.Fn->getProto();
+            Precedence.set(Proto.getOperatorName(Symbols),
+                           Proto.getBinaryPrecedence());
+        }
+        Item.End = P.getTokIdx();
+        B.Items.push_back(std::move(Item));
+    }
+}
+
+namespace {
+
+/// LoadedDef - What load remembers about a definition it compiled, to tell
+/// whether the next load of the file can keep the code already in the JIT.
+/// Hash covers the definition's source text and the token that ended it, as
+/// NumTokens tokens from its def.  Callees are the functions and operators
+/// its body uses.
+struct LoadedDef {
+    uint64_t Hash;
+    size_t NumTokens;
+    std::vector<Symbol> Callees;
+};
+
+/// HashTokens - Hash the source text from the start of token Begin to the end
+/// of token Last.
+static uint64_t HashTokens(const Lexer& Lex, const TokenStream& Tokens,
+                           size_t Begin, size_t Last) {
+    SourceSpan First = Tokens.getSpan(Begin), End = Tokens.getSpan(Last);
+    SourceSpan Text = {First.Offset, End.Offset + End.Length - First.Offset};
+    return llvm::xxHash64(Lex.Source.getText(Text));
+}
+
+/// HashPrototype - Hash what code calling a function is generated from: its
+/// arity, parameter and return types, array lengths, precedence and whether
+/// it is pure.
+static uint64_t HashPrototype(const PrototypeAST& Proto) {
+    std::vector<uint64_t> Words = {Proto.getArgs().size(),
+                                   Proto.getReturnType(),
+                                   Proto.getBinaryPrecedence(),
+                                   Proto.isPure()};
+    for (ValueType Ty : Proto.getArgTypes())
+        Words.push_back(Ty);
+    for (int Length : Proto.getArgLengths())
+        Words.push_back((uint64_t)Length);
+    return llvm::xxHash64(llvm::StringRef((const char*)Words.data(),
+                                          Words.size() * sizeof(uint64_t)));
+}
+
+/// DefinitionName - The name of the function the def at token I defines, read
+/// straight from the tokens the way ParsePrototype reads it.  Returns false if
+/// the prototype is malformed.
+static bool DefinitionName(const TokenStream& Tokens, SymbolTable& Symbols,
+                           size_t I, Symbol& Name) {
+    if (Tokens.getKind(I + 1) == tok_pure)
+        ++I;
+    int Tok = Tokens.getKind(I + 1);
+    if (Tok == tok_identifier) {
+        Name = Tokens.getSymbol(I + 1);
+        return true;
+    }
+    if ((Tok != tok_unary && Tok != tok_binary) || I + 2 >= Tokens.size() ||
+        !isascii(Tokens.getKind(I + 2)))
+        return false;
+    Name = Symbols.operatorSymbol(Tok == tok_binary, (char)Tokens.getKind(I + 2));
+    return true;
+}
+
+/// AddCallers - Add to Names every loaded definition that calls one of them,
+/// directly or through other loaded definitions.
+static void AddCallers(const llvm::DenseMap<Symbol, LoadedDef>& Defs,
+                       llvm::DenseSet<Symbol>& Names) {
+    llvm::DenseMap<Symbol, std::vector<Symbol>> Callers;
+    for (const auto& Def : Defs)
+        for (Symbol Callee : Def.second.Callees)
+            Callers[Callee].push_back(Def.first);
+
+    std::vector<Symbol> Worklist(Names.begin(), Names.end());
+    while (!Worklist.empty()) {
+        auto It = Callers.find(Worklist.back());
+        Worklist.pop_back();
+        if (It == Callers.end())
+            continue;
+        for (Symbol Caller : It->second)
+            if (Names.insert(Caller).second)
+                Worklist.push_back(Caller);
+    }
+}
+
+/// CompilerInstance - One whole compiler: the symbol and operator tables, the
+/// lexer, token stream and parser, the code generator and the JIT.  Instances
+/// share nothing, so several can compile different inputs at the same time on
+/// different threads.  Verbose turns the REPL output (prompts, IR and
+/// evaluated values) on or off; errors are always reported.
+class CompilerInstance {
+public:
+    explicit CompilerInstance(bool Verbose = true)
+        : Lex(Symbols), Tokens(Lex), P(Tokens, Symbols, BinopPrecedence),
+          CG(Symbols, BinopPrecedence),
+          TheJIT(std::make_unique<llvm::orc::KaleidoscopeJIT>()),
+          Verbose(Verbose) { }
+
+    void InitializeModuleAndPassManager();
+    void HandleDefinition();
+    void HandleExtern();
+    void HandleTopLevelExpression();
+    bool EmitDefinition(std::unique_ptr<FunctionAST> FnAST);
+    void EmitExtern(std::unique_ptr<PrototypeAST> ProtoAST);
+    void EmitTopLevelExpression(std::unique_ptr<FunctionAST> FnAST);
+    void HandleLoad();
+    void LoadFile(llvm::StringRef Path);
+    void ForgetLoaded(Symbol Name);
+    void MainLoop();
+    void ParallelMainLoop(unsigned Jobs);
+
+    SymbolTable Symbols;
+    PrecedenceTable BinopPrecedence;
+    Lexer Lex;
+    TokenStream Tokens;
+    Parser P;
+    CodeGen CG;
+    // Declared after CG so it is destroyed before the LLVMContext its modules
+    // were created in.
+    std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+    // The definitions compiled by load, by function name.
+    llvm::DenseMap<Symbol, LoadedDef> LoadedDefs;
+    // The HashPrototype of every extern declared, by function name.
+    llvm::DenseMap<Symbol, uint64_t> ExternHashes;
+    bool Verbose;
+};
+
+} // end anonymous namespace
+
+void CompilerInstance::InitializeModuleAndPassManager() {
     // Open a new module
-    TheModule = std::make_unique<llvm::Module>("my cool jit", TheContext);
-    TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+    CG.TheModule = std::make_unique<llvm::Module>("my cool jit", CG.TheContext);
+    CG.ModuleFunctions.clear();
+    CG.TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
 
     // Create a new pass manager attached to it.
-    TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
+    CG.TheFPM = std::make_unique<llvm::legacy::FunctionPassManager>(CG.TheModule.get());
+    // Let the loop passes ask the target about vector widths and costs.
+    CG.TheFPM->add(llvm::createTargetTransformInfoWrapperPass(
+        TheJIT->getTargetMachine().getTargetIRAnalysis()));
 
     // Promote allocas to registers.
-    TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
+    CG.TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
     // Do simple "peephole" optimizations and bit-twiddling optzns.
-    TheFPM->add(llvm::createInstructionCombiningPass());
+    CG.TheFPM->add(llvm::createInstructionCombiningPass());
     // Reassociate expressions.
-    TheFPM->add(llvm::createReassociatePass());
+    CG.TheFPM->add(llvm::createReassociatePass());
     // Eliminate Common SubExpressions.
-    TheFPM->add(llvm::createGVNPass());
+    CG.TheFPM->add(llvm::createGVNPass());
     // Simplify the control flow graph (deleting unreachable blocks, etc).
-    TheFPM->add(llvm::createCFGSimplificationPass());
+    CG.TheFPM->add(llvm::createCFGSimplificationPass());
+
+    if (CG.LoopPasses) {
+        // Put loops in the form the vectorizer and unroller expect, and hoist
+        // what does not change out of them.
+        CG.TheFPM->add(llvm::createLoopRotatePass());
+        CG.TheFPM->add(llvm::createLICMPass());
+        CG.TheFPM->add(llvm::createIndVarSimplifyPass());
+        CG.TheFPM->add(llvm::createLoopVectorizePass());
+        CG.TheFPM->add(llvm::createLoopUnrollPass());
+        // Clean up after them.
+        CG.TheFPM->add(llvm::createInstructionCombiningPass());
+        CG.TheFPM->add(llvm::createCFGSimplificationPass());
+    }
+
+    CG.TheFPM->doInitialization();
+}
 
-    TheFPM->doInitialization();
+void CompilerInstance::HandleDefinition() {
+    if (auto FnAST = P.ParseDefinition()) {
+        ForgetLoaded(FnAST->getProto().getName());
+        EmitDefinition(std::move(FnAST));
+    } else {
+        P.getNextToken();
+    }
 }
 
-static void HandleDefinition() {
-    if (auto FnAST = ParseDefinition()) {
-        if (llvm::Function* FnIR = FnAST->codegen()) {
+/// EmitDefinition - Generate a function and add it to the JIT, returning
+/// whether it compiled.
+bool CompilerInstance::EmitDefinition(std::unique_ptr<FunctionAST> FnAST) {
+    if (llvm::Function* FnIR = FnAST->codegen(CG)) {
+        if (Verbose) {
             fprintf(stderr, "Read function definition: ");
             FnIR->print(llvm::errs());
             fprintf(stderr, "\n");
-            TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPassManager();
         }
+        TheJIT->addModule(std::move(CG.TheModule));
+        InitializeModuleAndPassManager();
+        return true;
+    }
+    return false;
+}
+
+void CompilerInstance::HandleExtern() {
+    if (auto ProtoAST = P.ParseExtern()) {
+        EmitExtern(std::move(ProtoAST));
     } else {
-        getNextToken();
+        P.getNextToken();
     }
 }
 
-static void HandleExtern() {
-    if (auto ProtoAST = ParseExtern()) {
-        if (llvm::Function* FnIR = ProtoAST->codegen()) {
+/// EmitExtern - Declare an external function.  Loaded definitions that call
+/// it were generated for its old prototype, so if that was different the
+/// next load must compile them again.
+void CompilerInstance::EmitExtern(std::unique_ptr<PrototypeAST> ProtoAST) {
+    if (llvm::Function* FnIR = ProtoAST->codegen(CG)) {
+        if (Verbose) {
             fprintf(stderr, "Read extern: ");
             FnIR->print(llvm::errs());
             fprintf(stderr, "\n");
-            FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
         }
-    } else {
-        getNextToken();
+        uint64_t Hash = HashPrototype(*ProtoAST);
+        auto Known = ExternHashes.insert({ProtoAST->getName(), Hash});
+        if (!Known.second && Known.first->second != Hash) {
+            Known.first->second = Hash;
+            ForgetLoaded(ProtoAST->getName());
+        }
+        CG.SetFunctionProto(std::move(ProtoAST));
     }
 }
 
-static void HandleTopLevelExpression() {
+void CompilerInstance::HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (FnAST->codegen()) {
-            // JIT the module containing the anonymous expression, keeping a handle so
-            // we can free it later.
-            auto H = TheJIT->addModule(std::move(TheModule));
-            InitializeModuleAndPassManager();
+    if (auto FnAST = P.ParseTopLevelExpr()) {
+        EmitTopLevelExpression(std::move(FnAST));
+    } else {
+        // Skip token for error recovery.
+        P.getNextToken();
+    }
+}
 
-            // Search the JIT for the __anon_expr symbol.
-            auto ExprSymbol = TheJIT->findSymbol("__anonymous_expr");
-            assert (ExprSymbol && "Function not found");
+void CompilerInstance::EmitTopLevelExpression(std::unique_ptr<FunctionAST> FnAST) {
+    if (FnAST->codegen(CG)) {
+        // JIT the module containing the anonymous expression, keeping a handle so
+        // we can free it later.
+        auto H = TheJIT->addModule(std::move(CG.TheModule));
+        InitializeModuleAndPassManager();
+
+        // Search the JIT for the __anon_expr symbol.
+        auto ExprSymbol = TheJIT->findSymbol("__anonymous_expr");
+        assert (ExprSymbol && "Function not found");
+
+        // Get the symbol's address and cast it to the right type (takes no
+        // arguments, returns a double) so we can call it as a native function.
+        double (*FP) () = (double (*) ()) (intptr_t)cantFail(ExprSymbol.getAddress());
+        double Result = FP();
+        if (Verbose)
+            fprintf(stderr, "Evaluated to %f\n", Result);
+
+        // Delete the anonymous expression module from the JIT.
+        TheJIT->removeModule(H);
+    }
+}
 
-            // Get the symbol's address and cast it to the right type (takes no
-            // arguments, returns a double) so we can call it as a native function.
-            double (*FP) () = (double (*) ()) (intptr_t)cantFail(ExprSymbol.getAddress());
-            fprintf(stderr, "Evaluated to %f\n", FP());
+/// HandleLoad - load <file>, a REPL command.
+void CompilerInstance::HandleLoad() {
+    std::string Path = Symbols.name(Tokens.getSymbol(P.getTokIdx())).str();
+    if (Path.empty())
+        fprintf(stderr, "Error: load needs a file name\n");
+    else
+        LoadFile(Path);
+    P.getNextToken(); // eat load <file>
+}
 
-            // Delete the anonymous expression module from the JIT.
-            TheJIT->removeModule(H);
+/// LoadFile - Compile a file into the session, as if its text were typed at
+/// the prompt, but without compiling a definition again if the file had it
+/// last time in the same words and nothing it calls has changed since.  Such
+/// a definition is skipped without being parsed and keeps the code already
+/// in the JIT.  Edited definitions, and everything that calls them, are
+/// compiled again; the new code shadows the old, which stays in the JIT as
+/// it would after typing the definitions again.  Externs and top-level
+/// expressions are always run, and an extern whose prototype changed counts
+/// as an edit to the function it declares.
+void CompilerInstance::LoadFile(llvm::StringRef Path) {
+    auto Start = std::chrono::steady_clock::now();
+    Lexer FileLex(Symbols);
+    TokenStream FileTokens(FileLex);
+    if (!FileLex.Source.openFile(Path))
+        return;
+    FileTokens.lexAll();
+
+    // Find the definitions whose text is unchanged, and which of them have to
+    // be compiled anyway because something they call is being compiled.
+    llvm::DenseMap<size_t, Symbol> Unchanged; // By token index of the def.
+    llvm::DenseSet<Symbol> Recompile, Seen;
+    Parser FileP(FileTokens, Symbols, BinopPrecedence);
+    for (size_t I = 0, E = FileTokens.size(); I != E; ++I) {
+        Symbol Name;
+        if (FileTokens.getKind(I) == tok_extern) {
+            // Errors are reported when the extern is run below.
+            FileP.seek(I);
+            QuietErrors = true;
+            auto ProtoAST = FileP.ParseExtern();
+            QuietErrors = false;
+            auto Known = ProtoAST ? ExternHashes.find(ProtoAST->getName())
+                                  : ExternHashes.end();
+            if (Known != ExternHashes.end() &&
+                Known->second != HashPrototype(*ProtoAST))
+                Recompile.insert(ProtoAST->getName());
+            continue;
         }
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
+        if (FileTokens.getKind(I) != tok_def ||
+            !DefinitionName(FileTokens, Symbols, I, Name))
+            continue;
+        auto It = LoadedDefs.find(Name);
+        if (Seen.insert(Name).second && It != LoadedDefs.end() &&
+            I + It->second.NumTokens < E &&
+            HashTokens(FileLex, FileTokens, I, I + It->second.NumTokens) ==
+                It->second.Hash)
+            Unchanged[I] = Name;
+        else
+            Recompile.insert(Name);
+    }
+    AddCallers(LoadedDefs, Recompile);
+
+    unsigned NumReused = 0, NumEdited = 0, NumCallers = 0, NumExprs = 0;
+    FileP.seek(0);
+    while (FileP.CurTok != tok_eof) {
+        size_t I = FileP.getTokIdx();
+        switch (FileP.CurTok) {
+            case ';': FileP.getNextToken(); continue;
+            case tok_extern:
+                if (auto ProtoAST = FileP.ParseExtern())
+                    EmitExtern(std::move(ProtoAST));
+                else
+                    FileP.getNextToken();
+                continue;
+            case tok_def: break;
+            default:
+                ++NumExprs;
+                if (auto FnAST = FileP.ParseTopLevelExpr())
+                    EmitTopLevelExpression(std::move(FnAST));
+                else
+                    FileP.getNextToken();
+                continue;
+        }
+
+        auto Skip = Unchanged.find(I);
+        if (Skip == Unchanged.end()) {
+            ++NumEdited;
+        } else if (Recompile.count(Skip->second) ||
+                   !LoadedDefs.count(Skip->second)) {
+            // The second case is a def forgotten by an extern run above.
+            ++NumCallers;
+        } else {
+            ++NumReused;
+            FileP.seek(I + LoadedDefs[Skip->second].NumTokens);
+            continue;
+        }
+
+        auto FnAST = FileP.ParseDefinition();
+        if (!FnAST) {
+            FileP.getNextToken();
+            continue;
+        }
+        Symbol Name = FnAST->getProto().getName();
+        LoadedDef Def;
+        Def.NumTokens = FileP.getTokIdx() - I;
+        Def.Hash = HashTokens(FileLex, FileTokens, I, I + Def.NumTokens);
+        Def.Callees = CollectCallees(FnAST->getPool(), Symbols);
+        if (EmitDefinition(std::move(FnAST)))
+            LoadedDefs[Name] = std::move(Def);
+        else
+            LoadedDefs.erase(Name);
     }
+
+    std::chrono::duration<double, std::milli> Ms =
+        std::chrono::steady_clock::now() - Start;
+    fprintf(stderr, "Loaded %s: %u definitions, %u unchanged and reused, %u "
+                    "compiled (%u edited or new, %u calling them), %u "
+                    "top-level expressions, in %.2f ms\n",
+            Path.str().c_str(), NumReused + NumEdited + NumCallers, NumReused,
+            NumEdited + NumCallers, NumEdited, NumCallers, NumExprs, Ms.count());
+}
+
+/// ForgetLoaded - Name is being defined, or declared with a new prototype, at
+/// the prompt.  Loaded definitions that call it were linked against the old
+/// code, so the next load must compile them again.
+void CompilerInstance::ForgetLoaded(Symbol Name) {
+    if (LoadedDefs.empty())
+        return;
+    llvm::DenseSet<Symbol> Stale;
+    Stale.insert(Name);
+    AddCallers(LoadedDefs, Stale);
+    for (Symbol S : Stale)
+        LoadedDefs.erase(S);
 }
 
-static void MainLoop() {
+void CompilerInstance::MainLoop() {
     while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok) {
+        if (Verbose)
+            fprintf(stderr, "ready> ");
+        switch (P.CurTok) {
             case tok_eof    : return;
-            case ';'        : getNextToken(); break;
+            case ';'        : P.getNextToken(); break;
             case tok_def    : HandleDefinition(); break;
             case tok_extern : HandleExtern(); break;
+            case tok_load   : HandleLoad(); break;
             default: 
                 HandleTopLevelExpression(); 
                 break;
@@ -1139,6 +4036,41 @@ static void MainLoop() {
     }
 }
 
+/// ParallelMainLoop - Compile the rest of the input like MainLoop, but parse
+/// all of it on Jobs threads before generating code for the items in order.
+/// An item that failed to parse, or a binary operator definition that did not
+/// install its precedence (because it was a redefinition or its body failed to
+/// generate), means later items may have parsed differently than MainLoop
+/// would parse them, so MainLoop takes over from there.
+void CompilerInstance::ParallelMainLoop(unsigned Jobs) {
+    Tokens.lexAll();
+    ParallelParser PP(Tokens, Symbols, BinopPrecedence);
+    PP.parse(P.getTokIdx(), Jobs);
+
+    for (ParseBatch& B : PP.Batches) {
+        for (ParsedItem& Item : B.Items) {
+            switch (Item.Kind) {
+                case tok_extern: EmitExtern(std::move(Item.Extern)); continue;
+                case 0: EmitTopLevelExpression(std::move(Item.Fn)); continue;
+            }
+
+            const PrototypeAST& Proto = Item.Fn->getProto();
+            char Op = Proto.isBinaryOp() ? Proto.getOperatorName(Symbols) : 0;
+            int Prec = Proto.getBinaryPrecedence();
+            ForgetLoaded(Proto.getName());
+            EmitDefinition(std::move(Item.Fn));
+            if (Op && BinopPrecedence.get(Op) != Prec) {
+                P.seek(Item.End);
+                return MainLoop();
+            }
+        }
+        if (B.ErrorTokIdx != ParseBatch::NoError) {
+            P.seek(B.ErrorTokIdx);
+            return MainLoop();
+        }
+    }
+}
+
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
@@ -1161,19 +4093,2079 @@ extern "C" DLLEXPORT double printd(double X) {
     return 0;
 }
 
-int main(int argc, char* argv[]) {
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();
+//===----------------------------------------------------------------------===//
+// Command line and benchmarks
+//===----------------------------------------------------------------------===//
 
-    fprintf(stderr, "ready> ");
-    getNextToken();
+enum BenchKind {
+    bench_none, bench_lex, bench_keywords, bench_numbers, bench_parse,
+    bench_precedence, bench_scale, bench_parallel, bench_scopes, bench_arrays,
+    bench_simd, bench_fastmath, bench_tailcalls, bench_operators
+};
+
+static llvm::cl::list<std::string> InputFilenames(
+    llvm::cl::Positional, llvm::cl::ZeroOrMore,
+    llvm::cl::desc("<input file, or none for the REPL on stdin>"));
+
+static llvm::cl::opt<BenchKind> Bench(
+    "bench", llvm::cl::desc("Time a compiler phase on the input file and exit"),
+    llvm::cl::init(bench_none),
+    llvm::cl::values(
+        clEnumValN(bench_lex, "lex",
+                   "lexing throughput: memory buffer vs getchar"),
+        clEnumValN(bench_keywords, "keywords",
+                   "keyword lookup: perfect hash vs strcmp chain"),
+        clEnumValN(bench_numbers, "numbers",
+                   "number literals: from_chars vs string + strtod"),
+        clEnumValN(bench_parse, "parse",
+                   "parsing: tokens lexed on demand vs prelexed"),
+        clEnumValN(bench_precedence, "precedence",
+                   "operator precedence: flat table vs std::map"),
+        clEnumValN(bench_scale, "scale",
+                   "whole compiles on 1..N threads, one CompilerInstance each"),
+        clEnumValN(bench_parallel, "parallel",
+                   "parsing one input on 1..N threads vs sequentially"),
+        clEnumValN(bench_scopes, "scopes",
+                   "variable scopes: scope stack vs DenseMap save/restore"),
+        clEnumValN(bench_arrays, "arrays",
+                   "the input's JIT-compiled distanceArray vs the C++ one"),
+        clEnumValN(bench_simd, "simd",
+                   "the input's array loops: for vs for simd"),
+        clEnumValN(bench_fastmath, "fast-math",
+                   "the input's run() under each -fast-math setting"),
+        clEnumValN(bench_tailcalls, "tail-calls",
+                   "the input's run() and count() stack use, -tail-calls on "
+                   "vs off"),
+        clEnumValN(bench_operators, "inline-operators",
+                   "the input's run(), -inline-operators on vs off")));
+
+static llvm::cl::opt<unsigned> Jobs(
+    "jobs", llvm::cl::init(0),
+    llvm::cl::desc("Threads for -parallel-parse, and the most -bench=scale and "
+                   "-bench=parallel run at once (default: one per hardware "
+                   "thread)"));
+
+static llvm::cl::opt<bool> ParallelParse(
+    "parallel-parse",
+    llvm::cl::desc("Parse the whole input on -jobs threads, split at top-level "
+                   "def and extern, before generating code for it"));
+
+static llvm::cl::opt<bool> PreLex(
+    "prelex", llvm::cl::init(true),
+    llvm::cl::desc("Lex a whole input file into the token stream before "
+                   "parsing it (default on; stdin is always lexed on demand)"));
+
+static llvm::cl::opt<bool> Simplify(
+    "simplify", llvm::cl::init(true),
+    llvm::cl::desc("Fold constants and simplify expressions before generating "
+                   "code (default on)"));
+
+static llvm::cl::opt<bool> InlineOperators(
+    "inline-operators", llvm::cl::init(true),
+    llvm::cl::desc("Generate user defined operators in place where they are "
+                   "used instead of calling them (default on)"));
+
+static llvm::cl::opt<bool> TailCalls(
+    "tail-calls", llvm::cl::init(true),
+    llvm::cl::desc("Compile calls a function makes to itself in tail position "
+                   "as loops (default on)"));
+
+static llvm::cl::opt<bool> Memoize(
+    "memoize", llvm::cl::init(true),
+    llvm::cl::desc("Cache the results of pure functions that call themselves "
+                   "(default on)"));
+
+static llvm::cl::opt<bool> FastMath(
+    "fast-math",
+    llvm::cl::desc("Let floating point arithmetic ignore IEEE rules: all of "
+                   "the -fast-math-* flags, and more"));
+
+static llvm::cl::opt<bool> FastMathContract(
+    "fast-math-contract",
+    llvm::cl::desc("Allow fusing a multiply and an add into an FMA"));
+
+static llvm::cl::opt<bool> FastMathReassoc(
+    "fast-math-reassoc",
+    llvm::cl::desc("Allow reassociating arithmetic, e.g. to split reductions"));
+
+static llvm::cl::opt<bool> FastMathNoNaNs(
+    "fast-math-nnan",
+    llvm::cl::desc("Assume arithmetic never sees or produces a NaN"));
+
+static llvm::cl::opt<bool> FastMathNoInfs(
+    "fast-math-ninf",
+    llvm::cl::desc("Assume arithmetic never sees or produces an infinity"));
+
+static llvm::cl::opt<bool> IntegerLoops(
+    "integer-loops", llvm::cl::init(true),
+    llvm::cl::desc("Count for loops with whole number start, step and a "
+                   "loop-invariant bound in i64 (default on)"));
+
+static llvm::cl::opt<bool> ElideBoundsChecks(
+    "elide-bounds-checks", llvm::cl::init(true),
+    llvm::cl::desc("Check the range of an integer loop against array lengths "
+                   "once, instead of each index by its variable (default on)"));
+
+static llvm::cl::opt<bool> LoopPasses(
+    "loop-passes", llvm::cl::init(true),
+    llvm::cl::desc("Run loop rotation, LICM, induction variable "
+                   "simplification, the loop vectorizer and the unroller on "
+                   "each function (default on; see -pass-remarks)"));
+
+/// GetFastMathFlags - The fast-math flags the options ask for.
+static llvm::FastMathFlags GetFastMathFlags() {
+    llvm::FastMathFlags FMF;
+    if (FastMath)
+        FMF.setFast();
+    if (FastMathContract)
+        FMF.setAllowContract(true);
+    if (FastMathReassoc)
+        FMF.setAllowReassoc();
+    if (FastMathNoNaNs)
+        FMF.setNoNaNs();
+    if (FastMathNoInfs)
+        FMF.setNoInfs();
+    return FMF;
+}
+
+static llvm::cl::opt<bool> LexCheck(
+    "lex-check",
+    llvm::cl::desc("Check that every scanning kernel lexes the input files "
+                   "exactly like the getchar lexer, then exit"));
+
+static llvm::cl::opt<bool> ArrayCheck(
+    "array-check",
+    llvm::cl::desc("Call the array functions of bench/bounds.ks, given as the "
+                   "input file, with indexes in and out of range, with and "
+                   "without -elide-bounds-checks, then exit"));
+
+/// GetJobs - The -jobs setting, or one thread per hardware thread.
+static unsigned GetJobs() {
+    if (Jobs)
+        return Jobs;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/// OpenInput - Point the lexer at the file named on the command line, or at
+/// standard input if there is none.
+static bool OpenInput(CompilerInstance& CI) {
+    if (InputFilenames.size() > 1) {
+        fprintf(stderr, "Error: only one input file may be given\n");
+        return false;
+    }
+    CI.P.reset();
+    if (InputFilenames.empty() || InputFilenames[0] == "-") {
+        CI.Lex.Source.openStdin();
+        return true;
+    }
+    if (!CI.Lex.Source.openFile(InputFilenames[0]))
+        return false;
+    if (PreLex)
+        CI.Tokens.lexAll();
+    return true;
+}
+
+/// LookupKeywordChain - The compare-every-keyword test gettok did before
+/// LookupKeyword; kept as the -bench=keywords baseline.
+static int LookupKeywordChain(const std::string& IdentifierStr) {
+    if (IdentifierStr == "def")
+        return tok_def;
+    if (IdentifierStr == "extern")
+        return tok_extern;
+    if (IdentifierStr == "if")
+        return tok_if;
+    if (IdentifierStr == "then")
+        return tok_then;
+    if (IdentifierStr == "else")
+        return tok_else;
+    if (IdentifierStr == "for")
+        return tok_for;
+    if (IdentifierStr == "in")
+        return tok_in;
+    if (IdentifierStr == "binary")
+        return tok_binary;
+    if (IdentifierStr == "unary")
+        return tok_unary;
+    if (IdentifierStr == "var")
+        return tok_var;
+    if (IdentifierStr == "pure")
+        return tok_pure;
+    return tok_identifier;
+}
+
+/// ReferenceLexer - The lexer this file started out with, before SourceInput,
+/// the kscan kernels and LookupKeyword: one getc per byte, isspace and
+/// isalnum tests, the keywords compared one by one, and strtod.  It shares no
+/// code with Lexer, so it is kept as the -lex-check reference and the
+/// -bench=lex baseline.  It also
+/// records where each token starts so the two can be compared, but knows
+/// nothing of the load command or of malformed numbers.
+class ReferenceLexer {
+public:
+    ~ReferenceLexer() {
+        if (In)
+            fclose(In);
+    }
+
+    bool open(const std::string& Path) {
+        if (In)
+            fclose(In);
+        In = fopen(Path.c_str(), "r");
+        if (!In) {
+            fprintf(stderr, "Error: cannot open '%s'\n", Path.c_str());
+            return false;
+        }
+        LastChar = ' ';
+        Pos = 0;
+        return true;
+    }
+
+    int gettok();
 
-    TheJIT = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+    SourceSpan TokSpan;        // Source range of the last token
+    std::string IdentifierStr; // Filled in if tok_identifier
+    double NumVal = 0;         // Filled in if tok_number
 
-    InitializeModuleAndPassManager();
+private:
+    int next() {
+        ++Pos;
+        return getc(In);
+    }
+
+    FILE* In = nullptr;
+    int LastChar = ' ';
+    unsigned Pos = 0; // Characters read so far; LastChar is the last of them.
+};
+
+int ReferenceLexer::gettok() {
+    // Skip any whitespace.
+    while (isspace(LastChar))
+        LastChar = next();
+
+    TokSpan.Offset = Pos - 1;
+
+    if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+        IdentifierStr = LastChar;
+        while (isalnum((LastChar = next())))
+            IdentifierStr += LastChar;
+
+        TokSpan.Length = IdentifierStr.size();
+        return LookupKeywordChain(IdentifierStr);
+    }
+
+    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
+        std::string NumStr;
+        do {
+            NumStr += LastChar;
+            LastChar = next();
+        } while (isdigit(LastChar) || LastChar == '.');
+
+        TokSpan.Length = NumStr.size();
+        NumVal = strtod(NumStr.c_str(), nullptr);
+        return tok_number;
+    }
+
+    if (LastChar == '#') {
+        // Comment until end of line.
+        do
+            LastChar = next();
+        while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+
+        if (LastChar != EOF)
+            return gettok();
+    }
+
+    // Check for end of file.  Don't eat the EOF.
+    TokSpan.Length = 0;
+    if (LastChar == EOF)
+        return tok_eof;
+
+    // Otherwise, just return the character as its ascii value.
+    int ThisChar = LastChar;
+    LastChar = next();
+    TokSpan.Length = 1;
+    return ThisChar;
+}
+
+static double ElapsedMs(std::chrono::steady_clock::time_point Start) {
+    std::chrono::duration<double, std::milli> D =
+        std::chrono::steady_clock::now() - Start;
+    return D.count();
+}
+
+/// LexAll - Run the lexer to the end of the input, returning the token count.
+static size_t LexAll(Lexer& Lex) {
+    size_t NumTokens = 0;
+    while (Lex.gettok() != tok_eof)
+        ++NumTokens;
+    return NumTokens;
+}
+
+/// BenchLexer - Lex the whole file with ReferenceLexer, and through the
+/// memory buffer with each scanning kernel, reporting the best of a few runs
+/// of each.
+static int BenchLexer(const std::string& Path) {
+    const int Runs = 3;
+    size_t NumTokens = 0, NumBytes = 0;
+    SymbolTable Symbols;
+    Lexer Lex(Symbols);
+    ReferenceLexer Ref;
+
+    auto Time = [&](const char* Label, std::function<bool(size_t&)> LexFile) {
+        double Best = 1e300;
+        for (int i = 0; i < Runs; ++i) {
+            auto Start = std::chrono::steady_clock::now();
+            size_t N = 0;
+            if (!LexFile(N))
+                return false;
+            Best = std::min(Best, ElapsedMs(Start));
+            if (NumTokens && N != NumTokens) {
+                fprintf(stderr, "Error: %s produced a different token count\n", Label);
+                return false;
+            }
+            NumTokens = N;
+        }
+        double MB = NumBytes / (1024.0 * 1024.0);
+        fprintf(stderr, "  %-22s %9.2f ms %9.1f MB/s\n", Label, Best,
+                MB / (Best / 1000));
+        return true;
+    };
+
+    // The header needs the size and token count, so lex once untimed.
+    if (!Lex.Source.openFile(Path))
+        return 1;
+    NumTokens = LexAll(Lex);
+    NumBytes = Lex.Source.offset();
+    fprintf(stderr, "lex: %s, %.2f MB, %zu tokens\n", Path.c_str(),
+            NumBytes / (1024.0 * 1024.0), NumTokens);
+
+    bool Timed = Time("getchar (reference)", [&](size_t& N) {
+        if (!Ref.open(Path))
+            return false;
+        while (Ref.gettok() != tok_eof)
+            ++N;
+        return true;
+    });
+    if (!Timed)
+        return 1;
+
+    for (const kscan::ScanKernels* K : kscan::getAvailableKernels()) {
+        Lex.Scan = K;
+        std::string Label = std::string("memory buffer, ") + K->Name;
+        Timed = Time(Label.c_str(), [&](size_t& N) {
+            if (!Lex.Source.openFile(Path))
+                return false;
+            N = LexAll(Lex);
+            return true;
+        });
+        if (!Timed)
+            return 1;
+    }
+    return 0;
+}
+
+/// BenchKeywords - Classify every identifier and keyword in the file with the
+/// old strcmp chain and with the perfect hash.
+static int BenchKeywords(const std::string& Path) {
+    SymbolTable Symbols;
+    Lexer Lex(Symbols);
+    if (!Lex.Source.openFile(Path))
+        return 1;
+
+    std::vector<std::string> Words;
+    while (Lex.gettok() != tok_eof) {
+        llvm::StringRef Text = Lex.Source.getText(Lex.TokSpan);
+        if (!Text.empty() && isalpha(Text[0]))
+            Words.push_back(Text.str());
+    }
+    if (Words.empty()) {
+        fprintf(stderr, "Error: no identifiers in '%s'\n", Path.c_str());
+        return 1;
+    }
+
+    // Repeat small inputs so each timing covers at least ~10M lookups.
+    size_t Rounds = std::max<size_t>(1, 10000000 / Words.size());
+    long ChainSum = 0, HashSum = 0;
+
+    auto Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (const std::string& W : Words)
+            ChainSum += LookupKeywordChain(W);
+    double ChainMs = ElapsedMs(Start);
+
+    Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (const std::string& W : Words)
+            HashSum += LookupKeyword(W.data(), W.size());
+    double HashMs = ElapsedMs(Start);
+
+    if (ChainSum != HashSum) {
+        fprintf(stderr, "Error: perfect hash disagrees with the strcmp chain\n");
+        return 1;
+    }
 
-    MainLoop();
+    double Lookups = double(Rounds) * Words.size();
+    fprintf(stderr, "keywords: %s, %zu words x %zu rounds\n", Path.c_str(),
+            Words.size(), Rounds);
+    fprintf(stderr, "  strcmp chain:  %9.2f ms %7.2f ns/lookup\n", ChainMs,
+            ChainMs * 1e6 / Lookups);
+    fprintf(stderr, "  perfect hash:  %9.2f ms %7.2f ns/lookup\n", HashMs,
+            HashMs * 1e6 / Lookups);
+    return 0;
+}
+
+/// BenchNumbers - Convert every number literal in the file the old way
+/// (append to a std::string a character at a time, then strtod) and with
+/// ParseNumber.
+static int BenchNumbers(const std::string& Path) {
+    SymbolTable Symbols;
+    Lexer Lex(Symbols);
+    if (!Lex.Source.openFile(Path))
+        return 1;
+
+    std::vector<SourceSpan> Spans;
+    for (int Tok = Lex.gettok(); Tok != tok_eof; Tok = Lex.gettok())
+        if (Tok == tok_number)
+            Spans.push_back(Lex.TokSpan);
+    if (Spans.empty()) {
+        fprintf(stderr, "Error: no number literals in '%s'\n", Path.c_str());
+        return 1;
+    }
+
+    size_t Rounds = std::max<size_t>(1, 5000000 / Spans.size());
+    double StrtodSum = 0, ParseSum = 0;
+
+    auto Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (SourceSpan S : Spans) {
+            llvm::StringRef Text = Lex.Source.getText(S);
+            std::string NumStr;
+            for (char C : Text)
+                NumStr += C;
+            StrtodSum += strtod(NumStr.c_str(), nullptr);
+        }
+    double StrtodMs = ElapsedMs(Start);
+
+    Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (SourceSpan S : Spans) {
+            double Val;
+            ParseNumber(Lex.Source.getText(S), Val);
+            ParseSum += Val;
+        }
+    double ParseMs = ElapsedMs(Start);
+
+    if (StrtodSum != ParseSum) {
+        fprintf(stderr, "Error: from_chars and strtod disagree\n");
+        return 1;
+    }
+
+    double Conversions = double(Rounds) * Spans.size();
+    fprintf(stderr, "numbers: %s, %zu literals x %zu rounds\n", Path.c_str(),
+            Spans.size(), Rounds);
+    fprintf(stderr, "  string + strtod: %9.2f ms %7.2f ns/literal\n", StrtodMs,
+            StrtodMs * 1e6 / Conversions);
+    fprintf(stderr, "  from_chars:      %9.2f ms %7.2f ns/literal\n", ParseMs,
+            ParseMs * 1e6 / Conversions);
+    return 0;
+}
+
+/// ASTStats - How big the ASTs ParseAll parsed were.
+struct ASTStats {
+    size_t Nodes = 0;
+    size_t Bytes = 0;
+};
+
+/// ParseAll - Parse the rest of the input the way MainLoop does, but without
+/// generating code.  Binary operator precedences are installed as their
+/// definitions are parsed, since codegen is not there to do it.  The ASTs are
+/// kept in Items if it is given.
+static size_t ParseAll(CompilerInstance& CI, ASTStats* Stats = nullptr,
+                       std::vector<ParsedItem>* Items = nullptr) {
+    Parser& P = CI.P;
+    size_t NumItems = 0;
+    P.getNextToken();
+    while (P.CurTok != tok_eof) {
+        std::unique_ptr<PrototypeAST> ProtoAST;
+        std::unique_ptr<FunctionAST> FnAST;
+        int Kind = P.CurTok;
+        switch (P.CurTok) {
+            case ';': P.getNextToken(); continue;
+            case tok_def: FnAST = P.ParseDefinition(); break;
+            case tok_extern: ProtoAST = P.ParseExtern(); break;
+            default: Kind = 0; FnAST = P.ParseTopLevelExpr(); break;
+        }
+
+        const PrototypeAST* Proto = FnAST ? &FnAST->getProto() : ProtoAST.get();
+        if (!Proto) {
+            P.getNextToken(); // Skip token for error recovery.
+            continue;
+        }
+        if (Kind == tok_def && Proto->isBinaryOp())
+            CI.BinopPrecedence.set(Proto->getOperatorName(CI.Symbols),
+                                   Proto->getBinaryPrecedence());
+        if (Stats && FnAST) {
+            Stats->Nodes += FnAST->getPool().size();
+            Stats->Bytes += FnAST->getPool().getMemoryUsage();
+        }
+        if (Items)
+            Items->push_back({Kind, std::move(FnAST), std::move(ProtoAST),
+                              P.getTokIdx()});
+        ++NumItems;
+    }
+    return NumItems;
+}
+
+/// SetCodeGenOptions - Set the code generator's options from the command
+/// line.
+static void SetCodeGenOptions(CodeGen& CG) {
+    CG.SimplifyAST = Simplify;
+    CG.InlineOperators = InlineOperators;
+    CG.SelfTailCalls = TailCalls;
+    CG.MemoizePure = Memoize;
+    CG.FastMath = GetFastMathFlags();
+    CG.IntegerLoops = IntegerLoops;
+    CG.ElideBoundsChecks = ElideBoundsChecks;
+    CG.LoopPasses = LoopPasses;
+}
+
+/// CompileInto - Compile Path from start to finish the way the REPL would, in
+/// CI.  Adjust, if given, changes the code generator's options after the
+/// command line has set them.
+static bool CompileInto(CompilerInstance& CI, const std::string& Path,
+                        std::function<void(CodeGen&)> Adjust = nullptr) {
+    SetCodeGenOptions(CI.CG);
+    if (Adjust)
+        Adjust(CI.CG);
+    if (!CI.Lex.Source.openFile(Path))
+        return false;
+    if (PreLex)
+        CI.Tokens.lexAll();
+    CI.P.getNextToken();
+    CI.InitializeModuleAndPassManager();
+    CI.MainLoop();
+    return true;
+}
+
+/// CompileFile - CompileInto a CompilerInstance of its own.
+static bool CompileFile(const std::string& Path) {
+    CompilerInstance CI(/*Verbose=*/false);
+    return CompileInto(CI, Path);
+}
+
+//===----------------------------------------------------------------------===//
+// Pointer tree AST, the -bench=parse baseline
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// HashMix - Mix V into the hash H.
+static uint64_t HashMix(uint64_t H, uint64_t V) {
+  return (H ^ V) * 0x100000001b3ull;
+}
+
+/// TreeExpr - An expression node of the pointer tree the parser built before
+/// ExprPool; kept as the -bench=parse baseline.  Each node is an object of
+/// its own in a BumpPtrAllocator per function body, children are pointers,
+/// and lists are ArrayRefs into the same arena, so no node needs destroying.
+/// hash mixes the node and then its children into H, the same way that
+/// PoolHasher walks a pool, so the two walks can be checked against each
+/// other.
+class TreeExpr {
+public:
+  virtual uint64_t hash(uint64_t H) const = 0;
+};
+
+class TreeNumber : public TreeExpr {
+  double Val;
+
+public:
+  TreeNumber(double Val) : Val(Val) {}
+  uint64_t hash(uint64_t H) const override {
+    uint64_t Bits;
+    memcpy(&Bits, &Val, sizeof(Bits));
+    return HashMix(HashMix(H, EK_Number), Bits);
+  }
+};
+
+class TreeVariable : public TreeExpr {
+  Symbol Name;
+
+public:
+  TreeVariable(Symbol Name) : Name(Name) {}
+  uint64_t hash(uint64_t H) const override {
+    return HashMix(HashMix(H, EK_Variable), Name);
+  }
+};
+
+class TreeUnary : public TreeExpr {
+  char Op;
+  TreeExpr* Operand;
+
+public:
+  TreeUnary(char Op, TreeExpr* Operand) : Op(Op), Operand(Operand) {}
+  uint64_t hash(uint64_t H) const override {
+    return Operand->hash(HashMix(HashMix(H, EK_Unary), Op));
+  }
+};
+
+class TreeBinary : public TreeExpr {
+  char Op;
+  TreeExpr *LHS, *RHS;
+
+public:
+  TreeBinary(char Op, TreeExpr* LHS, TreeExpr* RHS)
+      : Op(Op), LHS(LHS), RHS(RHS) {}
+  uint64_t hash(uint64_t H) const override {
+    return RHS->hash(LHS->hash(HashMix(HashMix(H, EK_Binary), Op)));
+  }
+};
+
+class TreeCall : public TreeExpr {
+  Symbol Callee;
+  llvm::ArrayRef<TreeExpr*> Args;
+
+public:
+  TreeCall(Symbol Callee, llvm::ArrayRef<TreeExpr*> Args)
+      : Callee(Callee), Args(Args) {}
+  uint64_t hash(uint64_t H) const override {
+    H = HashMix(HashMix(H, EK_Call), Callee);
+    for (TreeExpr* Arg : Args)
+      H = Arg->hash(H);
+    return H;
+  }
+};
+
+class TreeIf : public TreeExpr {
+  TreeExpr *Cond, *Then, *Else;
+
+public:
+  TreeIf(TreeExpr* Cond, TreeExpr* Then, TreeExpr* Else)
+      : Cond(Cond), Then(Then), Else(Else) {}
+  uint64_t hash(uint64_t H) const override {
+    return Else->hash(Then->hash(Cond->hash(HashMix(H, EK_If))));
+  }
+};
+
+class TreeFor : public TreeExpr {
+  Symbol VarName;
+  ValueType VarType;
+  uint32_t Hints;
+  TreeExpr *Start, *End;
+  TreeExpr* Step; // May be null.
+  TreeExpr* Body;
+
+public:
+  TreeFor(Symbol VarName, ValueType VarType, uint32_t Hints, TreeExpr* Start,
+          TreeExpr* End, TreeExpr* Step, TreeExpr* Body)
+      : VarName(VarName), VarType(VarType), Hints(Hints), Start(Start),
+        End(End), Step(Step), Body(Body) {}
+  uint64_t hash(uint64_t H) const override {
+    H = HashMix(HashMix(HashMix(HashMix(H, EK_For), VarType), VarName), Hints);
+    H = End->hash(Start->hash(H));
+    if (Step)
+      H = Step->hash(H);
+    return Body->hash(H);
+  }
+};
+
+/// TreeBinding - One variable a TreeVar binds; Init may be null.
+struct TreeBinding {
+  Symbol Name;
+  ValueType Type;
+  TreeExpr* Init;
+};
+
+class TreeVar : public TreeExpr {
+  llvm::ArrayRef<TreeBinding> Vars;
+  TreeExpr* Body;
+
+public:
+  TreeVar(llvm::ArrayRef<TreeBinding> Vars, TreeExpr* Body)
+      : Vars(Vars), Body(Body) {}
+  uint64_t hash(uint64_t H) const override {
+    H = HashMix(H, EK_Var);
+    for (const TreeBinding& V : Vars) {
+      H = HashMix(HashMix(H, V.Name), V.Type);
+      if (V.Init)
+        H = V.Init->hash(H);
+    }
+    return Body->hash(H);
+  }
+};
+
+class TreeIndex : public TreeExpr {
+  Symbol Name;
+  TreeExpr* Index;
+
+public:
+  TreeIndex(Symbol Name, TreeExpr* Index) : Name(Name), Index(Index) {}
+  uint64_t hash(uint64_t H) const override {
+    return Index->hash(HashMix(HashMix(H, EK_Index), Name));
+  }
+};
+
+class TreeVector : public TreeExpr {
+  unsigned Lanes;
+  llvm::ArrayRef<TreeExpr*> Elts;
+
+public:
+  TreeVector(unsigned Lanes, llvm::ArrayRef<TreeExpr*> Elts)
+      : Lanes(Lanes), Elts(Elts) {}
+  uint64_t hash(uint64_t H) const override {
+    H = HashMix(HashMix(H, EK_Vector), Lanes);
+    for (TreeExpr* Elt : Elts)
+      H = Elt->hash(H);
+    return H;
+  }
+};
+
+/// TreeBuilder - Build a function body, given as a pool, as a pointer tree
+/// in Arena, allocating node by node as the parser used to.
+class TreeBuilder : public ExprVisitor<TreeBuilder, TreeExpr*> {
+public:
+    TreeBuilder(const ExprPool& Pool, llvm::BumpPtrAllocator& Arena)
+        : ExprVisitor<TreeBuilder, TreeExpr*>(Pool), Arena(Arena) { }
+
+    size_t NumNodes = 0;
+
+    TreeExpr* visitNumber(ExprNode N) { return make<TreeNumber>(Pool.getNumber(N)); }
+    TreeExpr* visitVariable(ExprNode N) { return make<TreeVariable>(N.A); }
+    TreeExpr* visitUnary(ExprNode N) { return make<TreeUnary>(N.Op, visit(N.A)); }
+    TreeExpr* visitBinary(ExprNode N) {
+        TreeExpr* LHS = visit(N.A);
+        return make<TreeBinary>(N.Op, LHS, visit(N.B));
+    }
+    TreeExpr* visitCall(ExprNode N) {
+        return make<TreeCall>(N.A, visitList(Pool.getExtra(N.B, N.C)));
+    }
+    TreeExpr* visitIf(ExprNode N) {
+        TreeExpr* Cond = visit(N.A);
+        TreeExpr* Then = visit(N.B);
+        return make<TreeIf>(Cond, Then, visit(N.C));
+    }
+    TreeExpr* visitFor(ExprNode N) {
+        llvm::ArrayRef<uint32_t> Parts = Pool.getExtra(N.B, 4);
+        TreeExpr* Start = visit(Parts[0]);
+        TreeExpr* End = visit(Parts[1]);
+        TreeExpr* Step = Parts[2] == NoExpr ? nullptr : visit(Parts[2]);
+        return make<TreeFor>(N.A, ValueType(N.Op), N.C, Start, End, Step,
+                             visit(Parts[3]));
+    }
+    TreeExpr* visitVar(ExprNode N) {
+        llvm::ArrayRef<uint32_t> VarNames = Pool.getExtra(N.A, 3 * N.B);
+        llvm::SmallVector<TreeBinding, 4> Vars;
+        for (size_t i = 0; i != N.B; ++i) {
+            ExprIdx Init = VarNames[3 * i + 1];
+            Vars.push_back({VarNames[3 * i], ValueType(VarNames[3 * i + 2]),
+                            Init == NoExpr ? nullptr : visit(Init)});
+        }
+        llvm::ArrayRef<TreeBinding> Copy = copyArray<TreeBinding>(Vars);
+        return make<TreeVar>(Copy, visit(N.C));
+    }
+    TreeExpr* visitIndex(ExprNode N) { return make<TreeIndex>(N.A, visit(N.B)); }
+    TreeExpr* visitVector(ExprNode N) {
+        return make<TreeVector>(N.Op, visitList(Pool.getExtra(N.A, N.B)));
+    }
+
+private:
+    template <typename T, typename... ArgTs> T* make(ArgTs&&... Args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "arena-allocated nodes are never destroyed");
+        ++NumNodes;
+        return new (Arena.Allocate(sizeof(T), alignof(T)))
+            T(std::forward<ArgTs>(Args)...);
+    }
+
+    template <typename T> llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> Elts) {
+        T* Mem = Arena.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
+
+    llvm::ArrayRef<TreeExpr*> visitList(llvm::ArrayRef<uint32_t> Elts) {
+        llvm::SmallVector<TreeExpr*, 8> List;
+        for (ExprIdx E : Elts)
+            List.push_back(visit(E));
+        return copyArray<TreeExpr*>(List);
+    }
+
+    llvm::BumpPtrAllocator& Arena;
+};
+
+/// PoolBuilder - Build a function body, given as a pool, again in the pool
+/// Out, children first as the parser does; TreeBuilder's counterpart.
+class PoolBuilder : public ExprVisitor<PoolBuilder, ExprIdx> {
+public:
+    PoolBuilder(const ExprPool& Pool, ExprPool& Out)
+        : ExprVisitor<PoolBuilder, ExprIdx>(Pool), Out(Out) { }
+
+    ExprIdx visitNumber(ExprNode N) { return Out.addNumber(Pool.getNumber(N)); }
+    ExprIdx visitVariable(ExprNode N) { return Out.add(EK_Variable, 0, N.A); }
+    ExprIdx visitUnary(ExprNode N) { return Out.add(EK_Unary, N.Op, visit(N.A)); }
+    ExprIdx visitBinary(ExprNode N) {
+        ExprIdx LHS = visit(N.A);
+        return Out.add(EK_Binary, N.Op, LHS, visit(N.B));
+    }
+    ExprIdx visitCall(ExprNode N) {
+        llvm::SmallVector<uint32_t, 8> Args;
+        for (ExprIdx Arg : Pool.getExtra(N.B, N.C))
+            Args.push_back(visit(Arg));
+        return Out.add(EK_Call, 0, N.A, Out.addExtra(Args), Args.size());
+    }
+    ExprIdx visitIf(ExprNode N) {
+        ExprIdx Cond = visit(N.A);
+        ExprIdx Then = visit(N.B);
+        return Out.add(EK_If, 0, Cond, Then, visit(N.C));
+    }
+    ExprIdx visitFor(ExprNode N) {
+        llvm::ArrayRef<uint32_t> Parts = Pool.getExtra(N.B, 4);
+        uint32_t NewParts[4];
+        for (int i = 0; i != 4; ++i)
+            NewParts[i] = Parts[i] == NoExpr ? NoExpr : visit(Parts[i]);
+        return Out.add(EK_For, N.Op, N.A, Out.addExtra(NewParts), N.C);
+    }
+    ExprIdx visitVar(ExprNode N) {
+        llvm::ArrayRef<uint32_t> VarNames = Pool.getExtra(N.A, 3 * N.B);
+        llvm::SmallVector<uint32_t, 12> Vars;
+        for (size_t i = 0; i != N.B; ++i) {
+            ExprIdx Init = VarNames[3 * i + 1];
+            Vars.push_back(VarNames[3 * i]);
+            Vars.push_back(Init == NoExpr ? NoExpr : visit(Init));
+            Vars.push_back(VarNames[3 * i + 2]);
+        }
+        ExprIdx Body = visit(N.C);
+        return Out.add(EK_Var, 0, Out.addExtra(Vars), N.B, Body);
+    }
+    ExprIdx visitIndex(ExprNode N) { return Out.add(EK_Index, 0, N.A, visit(N.B)); }
+    ExprIdx visitVector(ExprNode N) {
+        llvm::SmallVector<uint32_t, 8> Elts;
+        for (ExprIdx Elt : Pool.getExtra(N.A, N.B))
+            Elts.push_back(visit(Elt));
+        return Out.add(EK_Vector, N.Op, Out.addExtra(Elts), Elts.size());
+    }
+
+private:
+    ExprPool& Out;
+};
+
+/// PoolHasher - Hash a function body the way TreeExpr::hash does.
+class PoolHasher : public ExprVisitor<PoolHasher, void> {
+public:
+    explicit PoolHasher(const ExprPool& Pool)
+        : ExprVisitor<PoolHasher, void>(Pool) { }
+
+    uint64_t H = 0;
+
+    void visitNumber(ExprNode N) {
+        double Val = Pool.getNumber(N);
+        uint64_t Bits;
+        memcpy(&Bits, &Val, sizeof(Bits));
+        H = HashMix(HashMix(H, EK_Number), Bits);
+    }
+    void visitVariable(ExprNode N) { H = HashMix(HashMix(H, EK_Variable), N.A); }
+    void visitUnary(ExprNode N) {
+        H = HashMix(HashMix(H, EK_Unary), N.Op);
+        visit(N.A);
+    }
+    void visitBinary(ExprNode N) {
+        H = HashMix(HashMix(H, EK_Binary), N.Op);
+        visit(N.A);
+        visit(N.B);
+    }
+    void visitCall(ExprNode N) {
+        H = HashMix(HashMix(H, EK_Call), N.A);
+        for (ExprIdx Arg : Pool.getExtra(N.B, N.C))
+            visit(Arg);
+    }
+    void visitIf(ExprNode N) {
+        H = HashMix(H, EK_If);
+        visit(N.A);
+        visit(N.B);
+        visit(N.C);
+    }
+    void visitFor(ExprNode N) {
+        H = HashMix(HashMix(HashMix(HashMix(H, EK_For), N.Op), N.A), N.C);
+        for (ExprIdx Part : Pool.getExtra(N.B, 4))
+            if (Part != NoExpr)
+                visit(Part);
+    }
+    void visitVar(ExprNode N) {
+        llvm::ArrayRef<uint32_t> VarNames = Pool.getExtra(N.A, 3 * N.B);
+        H = HashMix(H, EK_Var);
+        for (size_t i = 0; i != N.B; ++i) {
+            H = HashMix(HashMix(H, VarNames[3 * i]), VarNames[3 * i + 2]);
+            if (VarNames[3 * i + 1] != NoExpr)
+                visit(VarNames[3 * i + 1]);
+        }
+        visit(N.C);
+    }
+    void visitIndex(ExprNode N) {
+        H = HashMix(HashMix(H, EK_Index), N.A);
+        visit(N.B);
+    }
+    void visitVector(ExprNode N) {
+        H = HashMix(HashMix(H, EK_Vector), N.Op);
+        for (ExprIdx Elt : Pool.getExtra(N.A, N.B))
+            visit(Elt);
+    }
+};
+
+} // end anonymous namespace
+
+/// BenchTree - Build the bodies in Items as pointer trees and as pools, from
+/// the pools they were parsed into, then walk each to hash it.  Building
+/// both from the same pools leaves the parser out and times only the
+/// representations; the hashes must agree.
+static bool BenchTree(const std::vector<ParsedItem>& Items, int Runs) {
+    std::vector<const FunctionAST*> Bodies;
+    for (const ParsedItem& Item : Items)
+        if (Item.Fn)
+            Bodies.push_back(Item.Fn.get());
+
+    double TreeBuildMs = 1e300, PoolBuildMs = 1e300;
+    double TreeWalkMs = 1e300, PoolWalkMs = 1e300;
+    size_t TreeNodes = 0, TreeBytes = 0, PoolBytes = 0;
+    uint64_t TreeHash = 0, PoolHash = 0;
+    for (int i = 0; i < Runs; ++i) {
+        std::vector<llvm::BumpPtrAllocator> Arenas(Bodies.size());
+        std::vector<TreeExpr*> Trees(Bodies.size());
+        auto Start = std::chrono::steady_clock::now();
+        TreeNodes = 0;
+        for (size_t B = 0; B != Bodies.size(); ++B) {
+            TreeBuilder Builder(Bodies[B]->getPool(), Arenas[B]);
+            Trees[B] = Builder.visit(Bodies[B]->getBody());
+            TreeNodes += Builder.NumNodes;
+        }
+        TreeBuildMs = std::min(TreeBuildMs, ElapsedMs(Start));
+
+        std::vector<ExprPool> Pools(Bodies.size());
+        std::vector<ExprIdx> Roots(Bodies.size());
+        Start = std::chrono::steady_clock::now();
+        for (size_t B = 0; B != Bodies.size(); ++B)
+            Roots[B] = PoolBuilder(Bodies[B]->getPool(), Pools[B])
+                           .visit(Bodies[B]->getBody());
+        PoolBuildMs = std::min(PoolBuildMs, ElapsedMs(Start));
+
+        Start = std::chrono::steady_clock::now();
+        TreeHash = 0;
+        for (TreeExpr* Tree : Trees)
+            TreeHash = Tree->hash(TreeHash);
+        TreeWalkMs = std::min(TreeWalkMs, ElapsedMs(Start));
+
+        Start = std::chrono::steady_clock::now();
+        PoolHash = 0;
+        for (size_t B = 0; B != Bodies.size(); ++B) {
+            PoolHasher Hasher(Pools[B]);
+            Hasher.H = PoolHash;
+            Hasher.visit(Roots[B]);
+            PoolHash = Hasher.H;
+        }
+        PoolWalkMs = std::min(PoolWalkMs, ElapsedMs(Start));
+
+        TreeBytes = PoolBytes = 0;
+        for (const llvm::BumpPtrAllocator& Arena : Arenas)
+            TreeBytes += Arena.getBytesAllocated();
+        for (const ExprPool& Pool : Pools)
+            PoolBytes += Pool.getMemoryUsage();
+    }
+
+    if (TreeHash != PoolHash) {
+        fprintf(stderr, "Error: the tree and the pool hold different expressions\n");
+        return false;
+    }
+    fprintf(stderr, "  tree vs pool, %zu bodies, %zu nodes:\n", Bodies.size(),
+            TreeNodes);
+    fprintf(stderr, "    pointer tree: build %7.2f ms, walk %6.2f ms, %.1f bytes/node\n",
+            TreeBuildMs, TreeWalkMs, double(TreeBytes) / TreeNodes);
+    fprintf(stderr, "    flat pool:    build %7.2f ms, walk %6.2f ms, %.1f bytes/node\n",
+            PoolBuildMs, PoolWalkMs, double(PoolBytes) / TreeNodes);
+    return true;
+}
+
+/// BenchParser - Parse the file with tokens lexed on demand, as the REPL does,
+/// and with the whole file lexed into Tokens first, then compile it.  Also
+/// report how the ASTs were allocated, and time them against the pointer
+/// tree they replaced.
+static int BenchParser(const std::string& Path) {
+    const int Runs = 3;
+    double OnDemandMs = 1e300, LexMs = 1e300, ParseMs = 1e300;
+    double CompileMs = 1e300;
+    size_t NumItems = 0;
+    ASTStats Stats;
+    CompilerInstance CI(/*Verbose=*/false);
+
+    for (int i = 0; i < Runs; ++i) {
+        if (!CI.Lex.Source.openFile(Path))
+            return 1;
+        CI.P.reset();
+        auto Start = std::chrono::steady_clock::now();
+        NumItems = ParseAll(CI);
+        OnDemandMs = std::min(OnDemandMs, ElapsedMs(Start));
+    }
+
+    for (int i = 0; i < Runs; ++i) {
+        if (!CI.Lex.Source.openFile(Path))
+            return 1;
+        CI.P.reset();
+        auto Start = std::chrono::steady_clock::now();
+        CI.Tokens.lexAll();
+        LexMs = std::min(LexMs, ElapsedMs(Start));
+        Start = std::chrono::steady_clock::now();
+        Stats = ASTStats();
+        ParseAll(CI, &Stats);
+        ParseMs = std::min(ParseMs, ElapsedMs(Start));
+    }
+
+    for (int i = 0; i < Runs; ++i) {
+        auto Start = std::chrono::steady_clock::now();
+        if (!CompileFile(Path))
+            return 1;
+        CompileMs = std::min(CompileMs, ElapsedMs(Start));
+    }
+
+    std::vector<ParsedItem> Items;
+    if (!CI.Lex.Source.openFile(Path))
+        return 1;
+    CI.P.reset();
+    CI.Tokens.lexAll();
+    ParseAll(CI, nullptr, &Items);
+
+    fprintf(stderr, "parse: %s, %zu top-level items, %zu tokens, %.1f bytes/token\n",
+            Path.c_str(), NumItems, CI.Tokens.size(),
+            double(CI.Tokens.getMemoryUsage()) / CI.Tokens.size());
+    fprintf(stderr, "  lex on demand + parse: %9.2f ms\n", OnDemandMs);
+    fprintf(stderr, "  prelex + parse:        %9.2f ms (lex %.2f, parse %.2f)\n",
+            LexMs + ParseMs, LexMs, ParseMs);
+    fprintf(stderr, "  prelex + parse + codegen: %6.2f ms\n", CompileMs);
+    fprintf(stderr, "  AST: %zu nodes, %.1f bytes/node\n", Stats.Nodes,
+            double(Stats.Bytes) / Stats.Nodes);
+    return BenchTree(Items, Runs) ? 0 : 1;
+}
+
+/// MapPrecedence - The std::map<char, int> lookup GetTokPrecedence did before
+/// PrecedenceTable; kept as the -bench=precedence baseline.
+static int MapPrecedence(std::map<char, int>& BinopPrecedence, int Tok) {
+    if (!isascii(Tok))
+        return -1;
+
+    int TokPrec = BinopPrecedence[Tok];
+    if (TokPrec <= 0)
+        return -1;
+
+    return TokPrec;
+}
+
+/// BenchPrecedence - Parse the file, then look up the precedence of every
+/// token in it, as ParseBinOpRHS does between operands, through the old
+/// std::map and through PrecedenceTable.  Both hold the built-in operators
+/// and the ones the file defines.
+static int BenchPrecedence(const std::string& Path) {
+    CompilerInstance CI(/*Verbose=*/false);
+    if (!CI.Lex.Source.openFile(Path))
+        return 1;
+    CI.P.reset();
+    CI.Tokens.lexAll();
+    auto Start = std::chrono::steady_clock::now();
+    size_t NumItems = ParseAll(CI);
+    double ParseMs = ElapsedMs(Start);
+
+    std::vector<int> Toks;
+    for (size_t i = 0, e = CI.Tokens.size(); i != e; ++i)
+        Toks.push_back(CI.Tokens.getKind(i));
+    std::map<char, int> Map;
+    for (int C = 0; C < 128; ++C)
+        if (int Prec = CI.BinopPrecedence.get(C))
+            Map[C] = Prec;
+
+    size_t Rounds = std::max<size_t>(1, 20000000 / Toks.size());
+    long MapSum = 0, TableSum = 0;
+
+    Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (int Tok : Toks)
+            MapSum += MapPrecedence(Map, Tok);
+    double MapMs = ElapsedMs(Start);
+
+    Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (int Tok : Toks) {
+            int TokPrec = CI.BinopPrecedence.get(Tok);
+            TableSum += TokPrec <= 0 ? -1 : TokPrec;
+        }
+    double TableMs = ElapsedMs(Start);
+
+    if (MapSum != TableSum) {
+        fprintf(stderr, "Error: PrecedenceTable disagrees with the std::map\n");
+        return 1;
+    }
+
+    double Lookups = double(Rounds) * Toks.size();
+    fprintf(stderr, "precedence: %s, %zu top-level items parsed in %.2f ms\n",
+            Path.c_str(), NumItems, ParseMs);
+    fprintf(stderr, "  %zu tokens x %zu rounds\n", Toks.size(), Rounds);
+    fprintf(stderr, "  std::map:    %9.2f ms %7.2f ns/lookup\n", MapMs,
+            MapMs * 1e6 / Lookups);
+    fprintf(stderr, "  flat table:  %9.2f ms %7.2f ns/lookup\n", TableMs,
+            TableMs * 1e6 / Lookups);
+    return 0;
+}
+
+/// BenchScale - Compile the file on 1, 2, ... -jobs threads at once, each
+/// thread with its own CompilerInstance.  With no state shared between
+/// instances the time for N compiles should stay close to the time for one
+/// until the threads outnumber the cores.
+static int BenchScale(const std::string& Path) {
+    unsigned MaxJobs = GetJobs();
+
+    fprintf(stderr, "scale: %s, 1..%u threads (%u hardware threads)\n",
+            Path.c_str(), MaxJobs, std::thread::hardware_concurrency());
+    double OneMs = 0;
+    for (unsigned N = 1; N <= MaxJobs; ++N) {
+        std::vector<char> Ok(N, false);
+        std::vector<std::thread> Threads;
+        auto Start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < N; ++i)
+            Threads.emplace_back([&, i] { Ok[i] = CompileFile(Path); });
+        for (std::thread& T : Threads)
+            T.join();
+        double Ms = ElapsedMs(Start);
+
+        if (std::count(Ok.begin(), Ok.end(), false))
+            return 1;
+        if (N == 1)
+            OneMs = Ms;
+        fprintf(stderr, "  %2u threads: %9.2f ms %8.2f compiles/s  speedup %.2fx\n",
+                N, Ms, N * 1000 / Ms, N * OneMs / Ms);
+    }
+    return 0;
+}
+
+/// SameItem - Whether two parses of a top-level item gave the same AST.
+static bool SameItem(const ParsedItem& A, const ParsedItem& B) {
+    if (A.Kind != B.Kind || A.End != B.End || !A.Fn != !B.Fn)
+        return false;
+    const PrototypeAST& PA = A.Fn ? A.Fn->getProto() : *A.Extern;
+    const PrototypeAST& PB = B.Fn ? B.Fn->getProto() : *B.Extern;
+    if (PA.getName() != PB.getName() || PA.getArgs() != PB.getArgs() ||
+        PA.getArgTypes() != PB.getArgTypes() ||
+        PA.getArgLengths() != PB.getArgLengths() ||
+        PA.getReturnType() != PB.getReturnType() ||
+        PA.isUnaryOp() != PB.isUnaryOp() || PA.isBinaryOp() != PB.isBinaryOp() ||
+        PA.getBinaryPrecedence() != PB.getBinaryPrecedence() ||
+        PA.isPure() != PB.isPure())
+        return false;
+    return !A.Fn || (A.Fn->getBody() == B.Fn->getBody() &&
+                     A.Fn->getPool().isIdenticalTo(B.Fn->getPool()));
+}
+
+/// BenchParallel - Parse the file one item after another, as ParseAll does,
+/// then with a ParallelParser on 1, 2, ... -jobs threads, checking that each
+/// parallel parse gives exactly the same ASTs.  Lexing is not timed.
+static int BenchParallel(const std::string& Path) {
+    const int Runs = 3;
+    unsigned MaxJobs = GetJobs();
+    CompilerInstance CI(/*Verbose=*/false);
+    const PrecedenceTable Builtins = CI.BinopPrecedence;
+
+    std::vector<ParsedItem> Expected;
+    double SequentialMs = 1e300;
+    for (int i = 0; i < Runs; ++i) {
+        if (!CI.Lex.Source.openFile(Path))
+            return 1;
+        CI.P.reset();
+        CI.Tokens.lexAll();
+        CI.BinopPrecedence = Builtins;
+        Expected.clear();
+        auto Start = std::chrono::steady_clock::now();
+        ParseAll(CI, nullptr, &Expected);
+        SequentialMs = std::min(SequentialMs, ElapsedMs(Start));
+    }
+
+    fprintf(stderr, "parallel: %s, %zu top-level items, %zu tokens, "
+                    "1..%u threads (%u hardware threads)\n",
+            Path.c_str(), Expected.size(), CI.Tokens.size(), MaxJobs,
+            std::thread::hardware_concurrency());
+    fprintf(stderr, "  sequential: %9.2f ms\n", SequentialMs);
+
+    for (unsigned N = 1; N <= MaxJobs; ++N) {
+        double Ms = 1e300;
+        std::unique_ptr<ParallelParser> PP;
+        for (int i = 0; i < Runs; ++i) {
+            PP = std::make_unique<ParallelParser>(CI.Tokens, CI.Symbols, Builtins);
+            auto Start = std::chrono::steady_clock::now();
+            PP->parse(0, N);
+            Ms = std::min(Ms, ElapsedMs(Start));
+        }
+
+        size_t I = 0;
+        for (const ParseBatch& B : PP->Batches) {
+            if (B.ErrorTokIdx != ParseBatch::NoError) {
+                fprintf(stderr, "Error: -bench=parallel needs an input that "
+                                "parses without errors\n");
+                return 1;
+            }
+            for (const ParsedItem& Item : B.Items) {
+                if (I == Expected.size() || !SameItem(Item, Expected[I])) {
+                    fprintf(stderr, "Error: %u threads parsed item %zu "
+                                    "differently\n", N, I);
+                    return 1;
+                }
+                ++I;
+            }
+        }
+        if (I != Expected.size()) {
+            fprintf(stderr, "Error: %u threads parsed %zu of %zu items\n", N, I,
+                    Expected.size());
+            return 1;
+        }
+
+        fprintf(stderr, "  %2u threads: %9.2f ms in %3zu batches, %6.1f M tokens/s, "
+                        "speedup %.2fx, same ASTs\n",
+                N, Ms, PP->Batches.size(), CI.Tokens.size() / Ms / 1000,
+                SequentialMs / Ms);
+    }
+    return 0;
+}
+
+/// DenseMapScopes - NamedValues as it was before ScopedValues: a DenseMap,
+/// with visitFor and visitVar saving the bindings they shadow and putting them
+/// back.  Kept as the -bench=scopes baseline.
+class DenseMapScopes {
+public:
+    llvm::Value* lookup(Symbol Name) const { return Map.lookup(Name); }
+    size_t enterScope() const { return Saved.size(); }
+
+    void bind(Symbol Name, llvm::Value* V) {
+        Saved.push_back({Name, Map.lookup(Name)});
+        Map[Name] = V;
+    }
+
+    void leaveScope(size_t Scope) {
+        while (Saved.size() > Scope) {
+            if (Saved.back().second)
+                Map[Saved.back().first] = Saved.back().second;
+            else
+                Map.erase(Saved.back().first);
+            Saved.pop_back();
+        }
+    }
+
+    void clear() {
+        Map.clear();
+        Saved.clear();
+    }
+
+private:
+    llvm::DenseMap<Symbol, llvm::Value*> Map;
+    std::vector<std::pair<Symbol, llvm::Value*> > Saved;
+};
+
+/// ScopeReplay - Walk a function body making the binds, lookups and scope
+/// exits that codegen makes, against a Table of either kind, without
+/// generating any IR.  The values bound are stand-ins that are only compared,
+/// never dereferenced.  Returns a checksum of what the lookups found.
+template <typename Table>
+class ScopeReplay : public ExprVisitor<ScopeReplay<Table>, uintptr_t> {
+public:
+    ScopeReplay(Table& Values, const ExprPool& Pool)
+        : ExprVisitor<ScopeReplay<Table>, uintptr_t>(Pool), Values(Values) { }
+
+    size_t NumBinds = 0, NumLookups = 0;
+
+    uintptr_t run(const FunctionAST& F) {
+        Values.clear();
+        for (Symbol Arg : F.getProto().getArgs())
+            bind(Arg);
+        return this->visit(F.getBody());
+    }
+
+    uintptr_t visitNumber(ExprNode) { return 0; }
+    uintptr_t visitVariable(ExprNode N) { return lookup(N.A); }
+    uintptr_t visitUnary(ExprNode N) { return this->visit(N.A); }
+
+    uintptr_t visitBinary(ExprNode N) {
+        if (N.Op == '=' && this->Pool[N.A].Kind == EK_Variable)
+            return this->visit(N.B) + lookup(this->Pool[N.A].A);
+        return this->visit(N.A) + this->visit(N.B);
+    }
+
+    uintptr_t visitCall(ExprNode N) {
+        uintptr_t Sum = 0;
+        for (ExprIdx Arg : this->Pool.getExtra(N.B, N.C))
+            Sum += this->visit(Arg);
+        return Sum;
+    }
+
+    uintptr_t visitIf(ExprNode N) {
+        return this->visit(N.A) + this->visit(N.B) + this->visit(N.C);
+    }
+
+    uintptr_t visitFor(ExprNode N) {
+        llvm::ArrayRef<uint32_t> Parts = this->Pool.getExtra(N.B, 4);
+        uintptr_t Sum = this->visit(Parts[0]);
+        size_t Scope = Values.enterScope();
+        bind(N.A);
+        Sum += this->visit(Parts[3]);
+        if (Parts[2] != NoExpr)
+            Sum += this->visit(Parts[2]);
+        Sum += this->visit(Parts[1]);
+        Values.leaveScope(Scope);
+        return Sum;
+    }
+
+    uintptr_t visitVar(ExprNode N) {
+        llvm::ArrayRef<uint32_t> VarNames = this->Pool.getExtra(N.A, 3 * N.B);
+        uintptr_t Sum = 0;
+        size_t Scope = Values.enterScope();
+        for (unsigned i = 0, e = N.B; i < e; ++i) {
+            if (VarNames[3 * i + 1] != NoExpr)
+                Sum += this->visit(VarNames[3 * i + 1]);
+            bind(VarNames[3 * i]);
+        }
+        Sum += this->visit(N.C);
+        Values.leaveScope(Scope);
+        return Sum;
+    }
+
+    uintptr_t visitIndex(ExprNode N) { return lookup(N.A) + this->visit(N.B); }
+
+    uintptr_t visitVector(ExprNode N) {
+        uintptr_t Sum = 0;
+        for (ExprIdx Elt : this->Pool.getExtra(N.A, N.B))
+            Sum += this->visit(Elt);
+        return Sum;
+    }
+
+private:
+    void bind(Symbol Name) {
+        Values.bind(Name, reinterpret_cast<llvm::Value*>(++NumBinds * 16));
+    }
+
+    uintptr_t lookup(Symbol Name) {
+        ++NumLookups;
+        return reinterpret_cast<uintptr_t>(Values.lookup(Name));
+    }
+
+    Table& Values;
+};
+
+/// BenchScopes - Parse the file, then replay the scope operations codegen
+/// makes for every function body through the old DenseMap save/restore and
+/// through ScopedValues; then compile the whole file for scale.
+static int BenchScopes(const std::string& Path) {
+    CompilerInstance CI(/*Verbose=*/false);
+    if (!CI.Lex.Source.openFile(Path))
+        return 1;
+    CI.P.reset();
+    CI.Tokens.lexAll();
+    std::vector<ParsedItem> Items;
+    ParseAll(CI, nullptr, &Items);
+
+    std::vector<const FunctionAST*> Fns;
+    size_t NumNodes = 0;
+    for (const ParsedItem& Item : Items)
+        if (Item.Fn) {
+            Fns.push_back(Item.Fn.get());
+            NumNodes += Item.Fn->getPool().size();
+        }
+    if (!NumNodes) {
+        fprintf(stderr, "Error: no function bodies in '%s'\n", Path.c_str());
+        return 1;
+    }
+
+    // Repeat small inputs so each timing covers at least ~20M nodes.
+    size_t Rounds = std::max<size_t>(1, 20000000 / NumNodes);
+    size_t NumOps = 0;
+    uintptr_t MapSum = 0, StackSum = 0;
+
+    DenseMapScopes Map;
+    auto Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (const FunctionAST* F : Fns) {
+            ScopeReplay<DenseMapScopes> Replay(Map, F->getPool());
+            MapSum += Replay.run(*F);
+            NumOps += Replay.NumBinds + Replay.NumLookups;
+        }
+    double MapMs = ElapsedMs(Start);
+
+    ScopedValues Stack;
+    Start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < Rounds; ++r)
+        for (const FunctionAST* F : Fns)
+            StackSum += ScopeReplay<ScopedValues>(Stack, F->getPool()).run(*F);
+    double StackMs = ElapsedMs(Start);
+
+    if (MapSum != StackSum) {
+        fprintf(stderr, "Error: ScopedValues disagrees with the DenseMap\n");
+        return 1;
+    }
+
+    Start = std::chrono::steady_clock::now();
+    if (!CompileFile(Path))
+        return 1;
+    double CompileMs = ElapsedMs(Start);
+
+    fprintf(stderr, "scopes: %s, %zu functions, %zu nodes x %zu rounds, "
+                    "%zu binds and lookups\n",
+            Path.c_str(), Fns.size(), NumNodes, Rounds, NumOps);
+    fprintf(stderr, "  DenseMap save/restore: %9.2f ms %7.2f ns/op\n", MapMs,
+            MapMs * 1e6 / NumOps);
+    fprintf(stderr, "  scope stack:           %9.2f ms %7.2f ns/op\n", StackMs,
+            StackMs * 1e6 / NumOps);
+    fprintf(stderr, "  prelex + parse + codegen: %6.2f ms\n", CompileMs);
+    return 0;
+}
+
+/// distanceNative, distanceArrayNative - distanceArray as the C++ compiler
+/// builds it from cuda/dist_v2/aux_functions.cpp, for -bench=arrays.
+static float distanceNative(float x1, float x2) {
+    return std::sqrt((x2 - x1) * (x2 - x1));
+}
+
+static void distanceArrayNative(float* out, float* in, float ref, int n) {
+    for (int i = 0; i < n; ++i)
+        out[i] = distanceNative(ref, in[i]);
+}
+
+/// BenchArrays - Compile the file, which defines
+///   distanceArray(out:float[n] input:float[n] ref:float n:int)
+/// as bench/distance.ks does, and time the JIT-compiled function against
+/// distanceArrayNative over the same host buffers, checking that the two
+/// write the same floats.
+static int BenchArrays(const std::string& Path) {
+    const int Runs = 5;
+    const size_t N = 1 << 16;
+    const size_t Rounds = 2000;
+
+    CompilerInstance CI(/*Verbose=*/false);
+    if (!CompileInto(CI, Path))
+        return 1;
+    Symbol Name = CI.Symbols.intern("distanceArray");
+    const std::vector<ValueType> ArgTypes = {VT_FloatArray, VT_FloatArray,
+                                             VT_Float, VT_Int};
+    if (Name >= CI.CG.FunctionProtos.size() || !CI.CG.FunctionProtos[Name] ||
+        CI.CG.FunctionProtos[Name]->getArgTypes() != ArgTypes) {
+        fprintf(stderr, "Error: '%s' does not define distanceArray(out:float[] "
+                        "input:float[] ref:float n:int)\n", Path.c_str());
+        return 1;
+    }
+    auto Sym = CI.TheJIT->findSymbol("distanceArray");
+    if (!Sym) {
+        fprintf(stderr, "Error: distanceArray did not compile\n");
+        return 1;
+    }
+    auto Kernel = (double (*)(float*, float*, float, int64_t))(intptr_t)
+        cantFail(Sym.getAddress());
+
+    std::vector<float> In(N), Out(N), Expected(N);
+    for (size_t i = 0; i < N; ++i)
+        In[i] = float((i * 2654435761u) % 1000003) / 1000.0f;
+    const float Ref = 500.5f;
+
+    auto Time = [&](std::function<void()> Run) {
+        double Best = 1e300;
+        for (int r = 0; r < Runs; ++r) {
+            auto Start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < Rounds; ++i)
+                Run();
+            Best = std::min(Best, ElapsedMs(Start));
+        }
+        return Best;
+    };
+    double NativeMs = Time([&] {
+        distanceArrayNative(Expected.data(), In.data(), Ref, N);
+    });
+    double JITMs = Time([&] { Kernel(Out.data(), In.data(), Ref, N); });
+
+    size_t Mismatches = 0;
+    for (size_t i = 0; i < N; ++i)
+        Mismatches += memcmp(&Out[i], &Expected[i], sizeof(float)) != 0;
+    if (Mismatches) {
+        fprintf(stderr, "Error: %zu of %zu elements differ from the C++ "
+                        "distanceArray\n", Mismatches, N);
+        return 1;
+    }
+
+    double Elements = double(N) * Rounds;
+    fprintf(stderr, "arrays: %s, distanceArray over %zu floats x %zu rounds\n",
+            Path.c_str(), N, Rounds);
+    fprintf(stderr, "  C++:          %9.2f ms %7.3f ns/element\n", NativeMs,
+            NativeMs * 1e6 / Elements);
+    fprintf(stderr, "  Kaleidoscope: %9.2f ms %7.3f ns/element\n", JITMs,
+            JITMs * 1e6 / Elements);
+    return 0;
+}
+
+/// BenchSimd - Compile the file, which defines each kernel twice, with a for
+/// loop and with a for simd loop, as bench/simd.ks does:
+///   dot(x:float[n] y:float[n] n:int):float, and dotSimd
+///   saxpy(y:float[n] x:float[n] a:float n:int), and saxpySimd
+/// and time the two versions of each over the same host buffers, small
+/// enough to stay in cache.  saxpy must write the same floats either way;
+/// dot may round differently once its sum is reordered.
+static int BenchSimd(const std::string& Path) {
+    const int Runs = 5;
+    const size_t N = 4096;
+    const size_t Rounds = 20000;
+
+    CompilerInstance CI(/*Verbose=*/false);
+    if (!CompileInto(CI, Path))
+        return 1;
+    auto Lookup = [&](const char* Name,
+                      const std::vector<ValueType>& ArgTypes) -> intptr_t {
+        Symbol Sym = CI.Symbols.intern(Name);
+        if (Sym >= CI.CG.FunctionProtos.size() || !CI.CG.FunctionProtos[Sym] ||
+            CI.CG.FunctionProtos[Sym]->getArgTypes() != ArgTypes) {
+            fprintf(stderr, "Error: '%s' does not define %s\n", Path.c_str(), Name);
+            return 0;
+        }
+        auto Addr = CI.TheJIT->findSymbol(Name);
+        if (!Addr) {
+            fprintf(stderr, "Error: %s did not compile\n", Name);
+            return 0;
+        }
+        return (intptr_t)cantFail(Addr.getAddress());
+    };
+    const std::vector<ValueType> DotArgs = {VT_FloatArray, VT_FloatArray, VT_Int};
+    const std::vector<ValueType> SaxpyArgs = {VT_FloatArray, VT_FloatArray,
+                                              VT_Float, VT_Int};
+    typedef float (*DotFn)(float*, float*, int64_t);
+    typedef double (*SaxpyFn)(float*, float*, float, int64_t);
+    auto Dot = (DotFn)Lookup("dot", DotArgs);
+    auto DotSimd = (DotFn)Lookup("dotSimd", DotArgs);
+    auto Saxpy = (SaxpyFn)Lookup("saxpy", SaxpyArgs);
+    auto SaxpySimd = (SaxpyFn)Lookup("saxpySimd", SaxpyArgs);
+    if (!Dot || !DotSimd || !Saxpy || !SaxpySimd)
+        return 1;
+
+    std::vector<float> X(N), Y(N);
+    for (size_t i = 0; i < N; ++i) {
+        X[i] = float((i * 2654435761u) % 1000) / 1000.0f;
+        Y[i] = float((i * 40503u) % 1000) / 1000.0f;
+    }
+    std::vector<float> YFor = Y, YSimd = Y;
+    const float A = 1e-6f;
+
+    auto Time = [&](std::function<void()> Run) {
+        double Best = 1e300;
+        for (int r = 0; r < Runs; ++r) {
+            auto Start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < Rounds; ++i)
+                Run();
+            Best = std::min(Best, ElapsedMs(Start));
+        }
+        return Best;
+    };
+    volatile float Sink;
+    double DotMs = Time([&] { Sink = Dot(X.data(), Y.data(), N); });
+    double DotSimdMs = Time([&] { Sink = DotSimd(X.data(), Y.data(), N); });
+    double SaxpyMs = Time([&] { Saxpy(YFor.data(), X.data(), A, N); });
+    double SaxpySimdMs = Time([&] { SaxpySimd(YSimd.data(), X.data(), A, N); });
+    (void)Sink;
+
+    float DotFor = Dot(X.data(), Y.data(), N);
+    float DotVec = DotSimd(X.data(), Y.data(), N);
+    if (std::fabs(DotVec - DotFor) > 1e-4f * std::fabs(DotFor)) {
+        fprintf(stderr, "Error: dotSimd gives %g, dot %g\n", DotVec, DotFor);
+        return 1;
+    }
+    if (memcmp(YFor.data(), YSimd.data(), N * sizeof(float)) != 0) {
+        fprintf(stderr, "Error: saxpySimd and saxpy write different floats\n");
+        return 1;
+    }
+
+    double Elements = double(N) * Rounds;
+    fprintf(stderr, "simd: %s, %zu floats x %zu rounds\n", Path.c_str(), N, Rounds);
+    auto Report = [&](const char* Name, double ForMs, double SimdMs) {
+        fprintf(stderr, "  %-6s for:      %9.2f ms %7.3f ns/element\n", Name,
+                ForMs, ForMs * 1e6 / Elements);
+        fprintf(stderr, "  %-6s for simd: %9.2f ms %7.3f ns/element %6.2fx\n",
+                Name, SimdMs, SimdMs * 1e6 / Elements, ForMs / SimdMs);
+    };
+    Report("dot", DotMs, DotSimdMs);
+    Report("saxpy", SaxpyMs, SaxpySimdMs);
+    return 0;
+}
+
+/// RunSetting - One way for BenchRunSettings to compile the input: a label,
+/// and what it changes in the code generator's options.
+struct RunSetting {
+    const char* Label;
+    std::function<void(CodeGen&)> Adjust;
+};
+
+/// FindRun - The address of run(), which each file in bench/ defines to take
+/// no arguments and return a checksum of the work it did, or 0.
+static intptr_t FindRun(CompilerInstance& CI, const std::string& Path) {
+    Symbol Name = CI.Symbols.intern("run");
+    if (Name >= CI.CG.FunctionProtos.size() || !CI.CG.FunctionProtos[Name] ||
+        !CI.CG.FunctionProtos[Name]->getArgs().empty() ||
+        CI.CG.FunctionProtos[Name]->getReturnType() != VT_Double) {
+        fprintf(stderr, "Error: '%s' does not define run()\n", Path.c_str());
+        return 0;
+    }
+    auto Sym = CI.TheJIT->findSymbol("run");
+    if (!Sym) {
+        fprintf(stderr, "Error: run did not compile\n");
+        return 0;
+    }
+    return (intptr_t)cantFail(Sym.getAddress());
+}
+
+/// BenchRunSettings - Compile the file once under each setting, in a
+/// CompilerInstance of its own, and time its run(), reporting the best of a
+/// few calls and the speedup over the first setting.  If Exact, every setting
+/// must return the same result; otherwise they may round differently.
+static int BenchRunSettings(const char* Bench, const std::string& Path,
+                            llvm::ArrayRef<RunSetting> Settings, bool Exact) {
+    const int Runs = 3;
+
+    fprintf(stderr, "%s: %s, run() best of %d\n", Bench, Path.c_str(), Runs);
+    double FirstMs = 0, FirstResult = 0;
+    for (const RunSetting& S : Settings) {
+        CompilerInstance CI(/*Verbose=*/false);
+        if (!CompileInto(CI, Path, S.Adjust))
+            return 1;
+        auto Run = (double (*)())FindRun(CI, Path);
+        if (!Run)
+            return 1;
+
+        double Best = 1e300, Result = 0;
+        for (int r = 0; r < Runs; ++r) {
+            auto Start = std::chrono::steady_clock::now();
+            Result = Run();
+            Best = std::min(Best, ElapsedMs(Start));
+        }
+        if (&S == Settings.begin()) {
+            FirstMs = Best;
+            FirstResult = Result;
+        } else if (Exact && Result != FirstResult) {
+            fprintf(stderr, "Error: run() returns %.17g with %s, %.17g with "
+                            "%s\n", Result, S.Label, FirstResult,
+                    Settings[0].Label);
+            return 1;
+        }
+        fprintf(stderr, "  %-22s %9.2f ms %6.2fx  run() = %.17g\n", S.Label,
+                Best, FirstMs / Best, Result);
+    }
+    return 0;
+}
+
+/// BenchFastMath - Time run(), as bench/mandelbrot.ks and bench/reduction.ks
+/// define it, with strict IEEE arithmetic and with each fast-math flag.
+static int BenchFastMath(const std::string& Path) {
+    auto Flags = [](void (*Set)(llvm::FastMathFlags&)) {
+        return [Set](CodeGen& CG) {
+            CG.FastMath.clear();
+            Set(CG.FastMath);
+        };
+    };
+    const RunSetting Settings[] = {
+        {"strict", Flags([](llvm::FastMathFlags&) {})},
+        {"-fast-math-contract",
+         Flags([](llvm::FastMathFlags& F) { F.setAllowContract(true); })},
+        {"-fast-math-reassoc",
+         Flags([](llvm::FastMathFlags& F) { F.setAllowReassoc(); })},
+        {"-fast-math-nnan",
+         Flags([](llvm::FastMathFlags& F) { F.setNoNaNs(); })},
+        {"-fast-math-ninf",
+         Flags([](llvm::FastMathFlags& F) { F.setNoInfs(); })},
+        {"-fast-math", Flags([](llvm::FastMathFlags& F) { F.setFast(); })},
+    };
+    return BenchRunSettings("fast-math", Path, Settings, /*Exact=*/false);
+}
+
+/// BenchOperators - Time run(), as bench/mandelbrot.ks defines it, with user
+/// defined operators called and generated in place.
+static int BenchOperators(const std::string& Path) {
+    const RunSetting Settings[] = {
+        {"-inline-operators=0",
+         [](CodeGen& CG) { CG.InlineOperators = false; }},
+        {"-inline-operators", [](CodeGen& CG) { CG.InlineOperators = true; }},
+    };
+    return BenchRunSettings("inline-operators", Path, Settings,
+                            /*Exact=*/true);
+}
+
+/// StackUsed - Call F on a thread of its own with a stack of Size bytes,
+/// filled with a pattern first, and return how many bytes at the top of the
+/// stack no longer hold the pattern.  That includes what the thread library
+/// keeps there, the same for every call.
+static size_t StackUsed(size_t Size, std::function<void()> F) {
+    const unsigned char Fill = 0xa5;
+    unsigned char* Stack = (unsigned char*)aligned_alloc(4096, Size);
+    memset(Stack, Fill, Size);
+
+    pthread_attr_t Attr;
+    pthread_attr_init(&Attr);
+    pthread_attr_setstack(&Attr, Stack, Size);
+    pthread_t Thread;
+    auto Body = [](void* Arg) -> void* {
+        (*(std::function<void()>*)Arg)();
+        return nullptr;
+    };
+    if (pthread_create(&Thread, &Attr, Body, &F) == 0)
+        pthread_join(Thread, nullptr);
+    pthread_attr_destroy(&Attr);
+
+    size_t Untouched = 0;
+    while (Untouched != Size && Stack[Untouched] == Fill)
+        ++Untouched;
+    free(Stack);
+    return Size - Untouched;
+}
+
+/// BenchTailCalls - Time run() with -tail-calls on and off, as for
+/// bench/tailcalls.ks, then measure the stack that
+///   count(n acc) if n < 1 then acc else count(n - 1, acc + 1)
+/// uses for two depths each way.  With tail calls on it must be the same for
+/// both, and count(100000000, 0) must then run in a stack of 256 KB; without
+/// them that call would need gigabytes, so it is not made.
+static int BenchTailCalls(const std::string& Path) {
+    const RunSetting Settings[] = {
+        {"-tail-calls=0", [](CodeGen& CG) { CG.SelfTailCalls = false; }},
+        {"-tail-calls", [](CodeGen& CG) { CG.SelfTailCalls = true; }},
+    };
+    if (BenchRunSettings("tail-calls", Path, Settings, /*Exact=*/true))
+        return 1;
+
+    const double Shallow = 1000, Deep = 100000, Deepest = 100000000;
+    for (const RunSetting& S : Settings) {
+        CompilerInstance CI(/*Verbose=*/false);
+        if (!CompileInto(CI, Path, S.Adjust))
+            return 1;
+        Symbol Name = CI.Symbols.intern("count");
+        if (Name >= CI.CG.FunctionProtos.size() ||
+            !CI.CG.FunctionProtos[Name] ||
+            CI.CG.FunctionProtos[Name]->getArgTypes() !=
+                std::vector<ValueType>(2, VT_Double)) {
+            fprintf(stderr, "Error: '%s' does not define count(n acc)\n",
+                    Path.c_str());
+            return 1;
+        }
+        auto Sym = CI.TheJIT->findSymbol("count");
+        if (!Sym) {
+            fprintf(stderr, "Error: count did not compile\n");
+            return 1;
+        }
+        auto Count = (double (*)(double, double))(intptr_t)
+            cantFail(Sym.getAddress());
+
+        double Result = 0;
+        size_t ShallowBytes =
+            StackUsed(64 << 20, [&] { Result = Count(Shallow, 0); });
+        size_t DeepBytes =
+            StackUsed(64 << 20, [&] { Result = Count(Deep, 0); });
+        if (Result != Deep) {
+            fprintf(stderr, "Error: count(%.0f, 0) returned %g\n", Deep, Result);
+            return 1;
+        }
+        fprintf(stderr, "  %-22s count(%.0f, 0): %zu bytes of stack, "
+                        "count(%.0f, 0): %zu bytes\n",
+                S.Label, Shallow, ShallowBytes, Deep, DeepBytes);
+        if (!CI.CG.SelfTailCalls)
+            continue;
+
+        if (DeepBytes != ShallowBytes) {
+            fprintf(stderr, "Error: count uses more stack the deeper it "
+                            "recurses\n");
+            return 1;
+        }
+        auto Start = std::chrono::steady_clock::now();
+        StackUsed(256 << 10, [&] { Result = Count(Deepest, 0); });
+        double Ms = ElapsedMs(Start);
+        if (Result != Deepest) {
+            fprintf(stderr, "Error: count(%.0f, 0) returned %g\n", Deepest,
+                    Result);
+            return 1;
+        }
+        fprintf(stderr, "  %-22s count(%.0f, 0) in a 256 KB stack: %.2f ms\n",
+                S.Label, Deepest, Ms);
+    }
+    return 0;
+}
+
+static int RunBenchmark() {
+    if (InputFilenames.size() != 1 || InputFilenames[0] == "-") {
+        fprintf(stderr, "Error: -bench needs exactly one input file\n");
+        return 1;
+    }
+    const std::string& Path = InputFilenames[0];
+
+    switch (Bench) {
+        case bench_lex: return BenchLexer(Path);
+        case bench_keywords: return BenchKeywords(Path);
+        case bench_numbers: return BenchNumbers(Path);
+        case bench_parse: return BenchParser(Path);
+        case bench_precedence: return BenchPrecedence(Path);
+        case bench_scale: return BenchScale(Path);
+        case bench_parallel: return BenchParallel(Path);
+        case bench_scopes: return BenchScopes(Path);
+        case bench_arrays: return BenchArrays(Path);
+        case bench_simd: return BenchSimd(Path);
+        case bench_fastmath: return BenchFastMath(Path);
+        case bench_tailcalls: return BenchTailCalls(Path);
+        case bench_operators: return BenchOperators(Path);
+        case bench_none: break;
+    }
+    return 0;
+}
+
+/// LexedToken - A token and its payload, as compared by -lex-check.
+struct LexedToken {
+    int Tok;
+    SourceSpan Span;
+    double Num;
+};
+
+template <class LexerT>
+static std::vector<LexedToken> LexToVector(LexerT& Lex) {
+    std::vector<LexedToken> Toks;
+    int Tok;
+    do {
+        Tok = Lex.gettok();
+        Toks.push_back({Tok, Lex.TokSpan, Tok == tok_number ? Lex.NumVal : 0});
+    } while (Tok != tok_eof);
+    return Toks;
+}
+
+static bool SameToken(const LexedToken& A, const LexedToken& B) {
+    return A.Tok == B.Tok && A.Span.Offset == B.Span.Offset &&
+           A.Span.Length == B.Span.Length && A.Num == B.Num;
+}
+
+/// CheckLexer - Differential test of the lexer: with every set of scanning
+/// kernels this CPU supports, each file must lex to exactly the tokens
+/// ReferenceLexer produces.
+static int CheckLexer() {
+    unsigned Mismatches = 0;
+    for (const std::string& Path : InputFilenames) {
+        ReferenceLexer Ref;
+        if (!Ref.open(Path))
+            return 1;
+        std::vector<LexedToken> Expected = LexToVector(Ref);
+
+        SymbolTable Symbols;
+        Lexer Lex(Symbols);
+
+        for (const kscan::ScanKernels* K : kscan::getAvailableKernels()) {
+            Lex.Scan = K;
+            if (!Lex.Source.openFile(Path))
+                return 1;
+            std::vector<LexedToken> Got = LexToVector(Lex);
+
+            size_t i = 0, e = std::min(Expected.size(), Got.size());
+            while (i != e && SameToken(Expected[i], Got[i]))
+                ++i;
+            if (i == e && Expected.size() == Got.size())
+                continue;
+
+            ++Mismatches;
+            unsigned Offset = i != e ? Got[i].Span.Offset : Lex.Source.offset();
+            fprintf(stderr, "%s: %s kernels differ from the reference at "
+                            "token %zu (offset %u)\n",
+                    Path.c_str(), K->Name, i, Offset);
+        }
+    }
+
+    fprintf(stderr, "lex-check: %zu files, %zu kernels, %u mismatches\n",
+            InputFilenames.size(), kscan::getAvailableKernels().size(), Mismatches);
+    return Mismatches != 0;
+}
+
+/// ArrayShape - What CheckArrays looks for in the code generated for one of
+/// its functions: the guards that choose between a loop and its checked
+/// copy, and the calls to llvm.trap.
+struct ArrayShape {
+    unsigned Guards = 0;
+    unsigned Traps = 0;
+};
+
+/// GetArrayShape - Count what ArrayShape holds in F.  A guard is a branch to
+/// two blocks named alike but for the ".checked" emitCheckedCopy adds.
+static ArrayShape GetArrayShape(const llvm::Function& F) {
+    auto Unchecked = [](const llvm::BasicBlock* BB) {
+        std::string Name = BB->getName().str();
+        size_t Pos = Name.find(".checked");
+        return Pos == std::string::npos ? std::string()
+                                        : Name.erase(Pos, strlen(".checked"));
+    };
+    ArrayShape Shape;
+    for (const llvm::BasicBlock& BB : F) {
+        auto* Br = llvm::dyn_cast<llvm::BranchInst>(BB.getTerminator());
+        if (Br && Br->isConditional() &&
+            (Unchecked(Br->getSuccessor(1)) == Br->getSuccessor(0)->getName() ||
+             Unchecked(Br->getSuccessor(0)) == Br->getSuccessor(1)->getName()))
+            ++Shape.Guards;
+        for (const llvm::Instruction& I : BB)
+            if (auto* Call = llvm::dyn_cast<llvm::CallInst>(&I))
+                if (Call->getIntrinsicID() == llvm::Intrinsic::trap)
+                    ++Shape.Traps;
+    }
+    return Shape;
+}
+
+/// ArrayCase - One call CheckArrays makes, Fn(a, b, N, M, K), and what it
+/// must return, or Trap if it must trap.
+struct ArrayCase {
+    const char* Fn;
+    int64_t N, M, K;
+    float Expected;
+};
+
+static const float Trap = -1;
+
+/// CheckArrays - Compile bench/bounds.ks with and without
+/// -elide-bounds-checks, check the shape of the code each function gets, and
+/// call each function with lengths and indexes in and out of range.  Calls
+/// that must trap are made in a child process.  a[i] holds i + 1 and b[i]
+/// 10 * (i + 1), whatever lengths the call claims, so no call that should
+/// trap reads outside the host arrays.
+static int CheckArrays() {
+    static const ArrayCase Cases[] = {
+        {"get", 4, 0, 0, 1},          {"get", 4, 0, 3, 4},
+        {"get", 4, 0, 4, Trap},       {"get", 4, 0, -1, Trap},
+        {"get", -1, 0, 0, Trap},      {"sumTo", 8, 0, 8, 36},
+        {"sumTo", 8, 0, 3, 6},        {"sumTo", 8, 0, 0, 0},
+        {"sumTo", 8, 0, 9, Trap},     {"sumTo", -3, 0, 0, 0},
+        {"sumTo", -3, 0, 2, Trap},    {"dotTo", 8, 8, 8, 2040},
+        {"dotTo", 8, 4, 4, 300},      {"dotTo", 8, 4, 8, Trap},
+        {"dotTo", 4, 8, 8, Trap},     {"dotTo", 8, -8, 1, Trap},
+        {"triangle", 8, 8, 8, 480},   {"triangle", 8, 8, 9, Trap},
+        {"triangle", 4, 8, 8, Trap},  {"triangle", 8, 4, 8, Trap},
+        {"triangle", 0, 8, 1, Trap},
+    };
+    // Guards and traps each function must have when bounds checks are
+    // elided; without that, or without integer loops, none has a guard.
+    static const std::pair<const char*, ArrayShape> Shapes[] = {
+        {"get", {0, 1}}, {"sumTo", {1, 1}}, {"dotTo", {1, 1}},
+        {"triangle", {1, 1}},
+    };
+
+    if (InputFilenames.size() != 1) {
+        fprintf(stderr, "Error: -array-check needs bench/bounds.ks\n");
+        return 1;
+    }
+    const std::string& Path = InputFilenames[0];
+    std::vector<float> A(64), B(64);
+    for (size_t i = 0; i < A.size(); ++i) {
+        A[i] = i + 1;
+        B[i] = 10 * (i + 1);
+    }
+
+    unsigned Failures = 0;
+    for (bool Elide : {true, false}) {
+        const char* Setting =
+            Elide ? "-elide-bounds-checks" : "-elide-bounds-checks=0";
+        CompilerInstance CI(/*Verbose=*/false);
+        SetCodeGenOptions(CI.CG);
+        CI.CG.ElideBoundsChecks = Elide;
+        if (!CI.Lex.Source.openFile(Path))
+            return 1;
+        CI.InitializeModuleAndPassManager();
+        std::vector<ParsedItem> Items;
+        ParseAll(CI, nullptr, &Items);
+
+        // Generate each definition and look at it before the JIT takes it.
+        llvm::StringMap<ArrayShape> Generated;
+        for (ParsedItem& Item : Items) {
+            if (Item.Kind != tok_def)
+                continue;
+            llvm::Function* F = Item.Fn->codegen(CI.CG);
+            if (!F)
+                return 1;
+            Generated[F->getName()] = GetArrayShape(*F);
+            CI.TheJIT->addModule(std::move(CI.CG.TheModule));
+            CI.InitializeModuleAndPassManager();
+        }
+
+        for (const auto& S : Shapes) {
+            ArrayShape Want = S.second, Got = Generated.lookup(S.first);
+            if (!CI.CG.ElideBoundsChecks || !CI.CG.IntegerLoops)
+                Want.Guards = 0;
+            if (Got.Guards != Want.Guards || Got.Traps != Want.Traps) {
+                ++Failures;
+                fprintf(stderr, "%s: %s has %u guards and %u traps, not %u "
+                                "and %u\n", Setting, S.first, Got.Guards,
+                        Got.Traps, Want.Guards, Want.Traps);
+            }
+        }
+
+        for (const ArrayCase& C : Cases) {
+            auto Sym = CI.TheJIT->findSymbol(C.Fn);
+            if (!Sym) {
+                fprintf(stderr, "Error: '%s' does not define %s\n",
+                        Path.c_str(), C.Fn);
+                return 1;
+            }
+            auto Fn = (float (*)(float*, float*, int64_t, int64_t, int64_t))
+                (intptr_t)cantFail(Sym.getAddress());
+            auto Call = [&] { return Fn(A.data(), B.data(), C.N, C.M, C.K); };
+
+            // A trap kills the process, so make the call in a child first.
+            fflush(stderr);
+            pid_t Child = fork();
+            if (Child == 0) {
+                Call();
+                _exit(0);
+            }
+            int Status = 0;
+            waitpid(Child, &Status, 0);
+            bool Trapped = !WIFEXITED(Status);
+            float Result = Trapped ? Trap : Call();
+            if (Trapped != (C.Expected == Trap) ||
+                (!Trapped && Result != C.Expected)) {
+                ++Failures;
+                fprintf(stderr, "%s: %s(a, b, %lld, %lld, %lld) ", Setting,
+                        C.Fn, (long long)C.N, (long long)C.M, (long long)C.K);
+                if (Trapped)
+                    fprintf(stderr, "trapped");
+                else
+                    fprintf(stderr, "returned %g", Result);
+                if (C.Expected == Trap)
+                    fprintf(stderr, ", expected a trap\n");
+                else
+                    fprintf(stderr, ", expected %g\n", C.Expected);
+            }
+        }
+    }
+
+    fprintf(stderr, "array-check: %zu calls and %zu functions each way, %u "
+                    "failures\n", llvm::array_lengthof(Cases),
+            llvm::array_lengthof(Shapes), Failures);
+    return Failures != 0;
+}
+
+int main(int argc, char* argv[]) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+
+    if (LexCheck)
+        return CheckLexer();
+
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+
+    if (Bench != bench_none)
+        return RunBenchmark();
+    if (ArrayCheck)
+        return CheckArrays();
+
+    CompilerInstance CI;
+    SetCodeGenOptions(CI.CG);
+    if (!OpenInput(CI))
+        return 1;
+
+    fprintf(stderr, "ready> ");
+    CI.P.getNextToken();
+
+    CI.InitializeModuleAndPassManager();
+
+    if (ParallelParse)
+        CI.ParallelMainLoop(GetJobs());
+    else
+        CI.MainLoop();
 
     return 0;
 }
@@ -0,0 +1,184 @@
+//===- KaleidoscopeScan.h - Vectorized character scanning -------*- C++ -*-===//
+//
+// Contains the character-class scanning kernels used by the Kaleidoscope
+// lexer.  Each kernel advances over a run of bytes of one class and returns a
+// pointer to the first byte outside it, or End.  SSE2 and AVX2 versions test
+// 16 or 32 bytes per step; the best one the CPU supports is picked at run time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef KALEIDOSCOPE_SCAN_H
+#define KALEIDOSCOPE_SCAN_H
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace kscan {
+
+/// ScanKernels - One implementation of the three scans the lexer needs.  The
+/// classes match <cctype> in the C locale, so bytes >= 0x80 are in none.
+struct ScanKernels {
+  const char *Name;
+  /// skipSpace - Skip ' ', '\t', '\n', '\v', '\f' and '\r'.
+  const char *(*skipSpace)(const char *P, const char *End);
+  /// skipAlnum - Skip [0-9A-Za-z].
+  const char *(*skipAlnum)(const char *P, const char *End);
+  /// skipLine - Skip up to, but not including, the next '\n' or '\r'.
+  const char *(*skipLine)(const char *P, const char *End);
+};
+
+namespace detail {
+
+inline bool isSpace(unsigned char C) { return C == ' ' || C - 9u <= 4u; }
+inline bool isAlnum(unsigned char C) {
+  return unsigned(C - '0') <= 9u || (C | 0x20u) - 'a' <= 25u;
+}
+inline bool isEOL(unsigned char C) { return C == '\n' || C == '\r'; }
+
+inline const char *scalarSkipSpace(const char *P, const char *End) {
+  while (P != End && isSpace(*P))
+    ++P;
+  return P;
+}
+
+inline const char *scalarSkipAlnum(const char *P, const char *End) {
+  while (P != End && isAlnum(*P))
+    ++P;
+  return P;
+}
+
+inline const char *scalarSkipLine(const char *P, const char *End) {
+  while (P != End && !isEOL(*P))
+    ++P;
+  return P;
+}
+
+#ifdef KSCAN_X86
+
+// Unsigned "X - Lo <= Len" per byte, the vector form of the range tests above.
+#define KSCAN_IN_RANGE(W, X, Lo, Len)                                          \
+  _mm##W##_cmpeq_epi8(                                                         \
+      _mm##W##_min_epu8(_mm##W##_sub_epi8(X, _mm##W##_set1_epi8(Lo)),          \
+                        _mm##W##_set1_epi8(Len)),                              \
+      _mm##W##_sub_epi8(X, _mm##W##_set1_epi8(Lo)))
+
+__attribute__((target("sse2"))) inline __m128i sse2Space(__m128i X) {
+  return _mm_or_si128(_mm_cmpeq_epi8(X, _mm_set1_epi8(' ')),
+                      KSCAN_IN_RANGE(, X, 9, 4));
+}
+
+__attribute__((target("sse2"))) inline __m128i sse2Alnum(__m128i X) {
+  __m128i Lower = _mm_or_si128(X, _mm_set1_epi8(0x20));
+  return _mm_or_si128(KSCAN_IN_RANGE(, X, '0', 9),
+                      KSCAN_IN_RANGE(, Lower, 'a', 25));
+}
+
+__attribute__((target("sse2"))) inline __m128i sse2EOL(__m128i X) {
+  return _mm_or_si128(_mm_cmpeq_epi8(X, _mm_set1_epi8('\n')),
+                      _mm_cmpeq_epi8(X, _mm_set1_epi8('\r')));
+}
+
+__attribute__((target("avx2"))) inline __m256i avx2Space(__m256i X) {
+  return _mm256_or_si256(_mm256_cmpeq_epi8(X, _mm256_set1_epi8(' ')),
+                         KSCAN_IN_RANGE(256, X, 9, 4));
+}
+
+__attribute__((target("avx2"))) inline __m256i avx2Alnum(__m256i X) {
+  __m256i Lower = _mm256_or_si256(X, _mm256_set1_epi8(0x20));
+  return _mm256_or_si256(KSCAN_IN_RANGE(256, X, '0', 9),
+                         KSCAN_IN_RANGE(256, Lower, 'a', 25));
+}
+
+__attribute__((target("avx2"))) inline __m256i avx2EOL(__m256i X) {
+  return _mm256_or_si256(_mm256_cmpeq_epi8(X, _mm256_set1_epi8('\n')),
+                         _mm256_cmpeq_epi8(X, _mm256_set1_epi8('\r')));
+}
+
+#undef KSCAN_IN_RANGE
+
+// The While* templates skip bytes while the class test is true (Stop = false)
+// or until it becomes true (Stop = true), a block at a time, then finish the
+// last partial block with the scalar test.
+
+template <__m128i (*Class)(__m128i), bool Stop, bool (*Scalar)(unsigned char)>
+__attribute__((target("sse2"))) const char *sse2While(const char *P,
+                                                      const char *End) {
+  for (; End - P >= 16; P += 16) {
+    __m128i X = _mm_loadu_si128(reinterpret_cast<const __m128i *>(P));
+    unsigned Mask = _mm_movemask_epi8(Class(X));
+    if (!Stop)
+      Mask = ~Mask & 0xFFFF;
+    if (Mask)
+      return P + __builtin_ctz(Mask);
+  }
+  while (P != End && Scalar(*P) != Stop)
+    ++P;
+  return P;
+}
+
+template <__m256i (*Class)(__m256i), bool Stop, bool (*Scalar)(unsigned char)>
+__attribute__((target("avx2"))) const char *avx2While(const char *P,
+                                                      const char *End) {
+  for (; End - P >= 32; P += 32) {
+    __m256i X = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(P));
+    unsigned Mask = _mm256_movemask_epi8(Class(X));
+    if (!Stop)
+      Mask = ~Mask;
+    if (Mask)
+      return P + __builtin_ctz(Mask);
+  }
+  while (P != End && Scalar(*P) != Stop)
+    ++P;
+  return P;
+}
+
+#endif // KSCAN_X86
+
+} // end namespace detail
+
+inline const ScanKernels &getScalarKernels() {
+  static const ScanKernels K = {"scalar", detail::scalarSkipSpace,
+                                detail::scalarSkipAlnum,
+                                detail::scalarSkipLine};
+  return K;
+}
+
+/// getAvailableKernels - Every implementation this CPU can run, slowest
+/// first.  The scalar kernels are always present.
+inline const std::vector<const ScanKernels *> &getAvailableKernels() {
+  static const std::vector<const ScanKernels *> Kernels = [] {
+    std::vector<const ScanKernels *> V = {&getScalarKernels()};
+#ifdef KSCAN_X86
+    using namespace detail;
+    static const ScanKernels SSE2 = {"sse2",
+                                     sse2While<sse2Space, false, isSpace>,
+                                     sse2While<sse2Alnum, false, isAlnum>,
+                                     sse2While<sse2EOL, true, isEOL>};
+    static const ScanKernels AVX2 = {"avx2",
+                                     avx2While<avx2Space, false, isSpace>,
+                                     avx2While<avx2Alnum, false, isAlnum>,
+                                     avx2While<avx2EOL, true, isEOL>};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+      V.push_back(&SSE2);
+    if (__builtin_cpu_supports("avx2"))
+      V.push_back(&AVX2);
+#endif
+    return V;
+  }();
+  return Kernels;
+}
+
+/// getBestKernels - The fastest implementation this CPU supports.
+inline const ScanKernels &getBestKernels() {
+  return *getAvailableKernels().back();
+}
+
+} // end namespace kscan
+
+#endif // KALEIDOSCOPE_SCAN_H